@@ -4,14 +4,11 @@
 #include <libgen.h>
 #include <unistd.h>
 #include "cmidi2.h"
+#include "juceaap_ump.h"
 #include <aap/ext/parameters.h>
 #if ANDROID
 #include <android/sharedmem.h>
 #include <android/trace.h>
-#else
-namespace aap {
-extern void aap_parse_plugin_descriptor_into(const char* pluginPackageName, const char* pluginLocalName, const char* xmlfile, std::vector<PluginInformation*>& plugins);
-}
 #endif
 
 using namespace aap;
@@ -19,9 +16,26 @@ using namespace juce;
 
 #define AAP_JUCE_LOG_TAG "AAP-JUCE"
 
+#define MAX_ACCEPTABLE_PROCESS_NANOSECCONDS 10000000 // I think it's fair to say that one plugin taking 10msec. is not appropriate...
+#define MAX_BYPASS_DELAY_SECONDS 0.5 // the bypass delay line is preallocated for up to this much plugin latency.
+#define PROCESS_WORKER_STOP_TIMEOUT_MILLISECONDS 1000 // how long teardown waits for a plugin stuck in process().
+#define HIBERNATE_BLOCK_TIMEOUT_MILLISECONDS 100 // how long hibernate() waits for the running block.
+
+static inline int64_t getMonotonicNanoseconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
 namespace juceaap {
 
 double AndroidAudioPluginInstance::getTailLengthSeconds() const {
+    if (native == nullptr)
+        return hibernated_tail_seconds;
+    // aap-juce plugins report their tail in-band, while aap-core would return zero for them.
+    auto tail = plugin_tail_samples.load(std::memory_order_relaxed);
+    if (tail != TAIL_UNREPORTED && sample_rate > 0)
+        return tail < 0 ? std::numeric_limits<double>::infinity() : (double) tail / sample_rate;
     return native->getTailTimeInMilliseconds() / 1000.0;
 }
 
@@ -79,119 +93,168 @@ static void fillPluginDescriptionFromNativeInstance(PluginDescription &descripti
     }
 }
 
-static void* handleSysex7(uint64_t data, void* context) {
-    auto mbh = (AAPMidiBufferHeader*) context;
-    auto p = (uint32_t*) (void*) ((uint8_t*) mbh) + mbh->length + sizeof (mbh);
-    p[0] = data >> 32;
-    p[1] = data & 0xFFFFFFFF;
-    return nullptr;
+// The status notifications that aap-juce plugins (juceaap_AAPWrappers.cpp) send as one SysEx8 packet:
+// stream 0, non-commercial manufacturer ID 0x7D, 'J', the kind ('L' for latency in samples, 'O' for
+// the number of process deadline overruns, 'T' for the tail in samples, UINT32_MAX being infinite),
+// then the value as big-endian uint32.
+static bool readStatusSysex8(const uint32_t* src, uint8_t* kind, uint32_t* value) {
+    if ((src[0] & 0xF0FFFFFF) != (0x50000000 | (8 << 16) | 0x7D) || (src[1] >> 24) != 'J')
+        return false;
+    *kind = (uint8_t) ((src[1] >> 16) & 0xFF);
+    *value = ((src[1] & 0xFFFF) << 16) | (src[2] >> 16);
+    return true;
 }
 
 void AndroidAudioPluginInstance::preProcessBuffers(AudioBuffer<float> &audioBuffer,
                                                         MidiBuffer &midiMessages) {
-    // FIXME: RT lock
-
     // FIXME: there is some glitch between how JUCE AudioBuffer assigns a channel for each buffer item
     //  and how AAP expects them.
-    int juceInputsAssigned = 0;
     auto *buffer = native->getAudioPluginBuffer();
 
-    for (int portIndex = 0, numPorts = native->getNumPorts(); portIndex < numPorts; portIndex++) {
-        auto port = native->getPort(portIndex);
-        if (port->getPortDirection() != AAP_PORT_DIRECTION_INPUT)
-            continue;
-        if (port->getContentType() == AAP_CONTENT_TYPE_AUDIO &&
-            juceInputsAssigned < audioBuffer.getNumChannels())
-            memcpy(buffer->get_buffer(buffer, portIndex), (void *) audioBuffer.getReadPointer(juceInputsAssigned++),
-                   audioBuffer.getNumSamples() * sizeof(float));
-    }
+    auto numInputs = jmin((int) audio_in_ports.size(), audioBuffer.getNumChannels());
+    for (int i = 0; i < numInputs; i++)
+        memcpy(buffer->get_buffer(buffer, audio_in_ports[(size_t) i]), (void *) audioBuffer.getReadPointer(i),
+               audioBuffer.getNumSamples() * sizeof(float));
 
     if (aap_midi_in_port >= 0) { // it should be usually true as it supports all parameter changes.
         auto mbh = (AAPMidiBufferHeader*) buffer->get_buffer(buffer, aap_midi_in_port);
-
-        // Convert MidiBuffer into MIDI 2.0 UMP stream on the AAP port
-        MidiMessage msg{};
-        int pos{0};
-        const double oneTick = 1 / 31250.0; // sec
-        double secondsPerFrameJUCE = 1.0 / sample_rate; // sec
-        MidiBuffer::Iterator iter{midiMessages};
-        size_t dstIntIndex = mbh->length;
-        uint32_t *dstI = (uint32_t *) (void*) (mbh + 1);
-
-        while (iter.getNextEvent(msg, pos)) {
-            // generate UMP Timestamps only when message has non-zero timestamp.
-            double timestamp = msg.getTimeStamp();
-            if (timestamp != 0) {
-                double timestampSeconds = timestamp * secondsPerFrameJUCE;
-                int32_t timestampTicks = (int32_t) (timestampSeconds / oneTick);
-                do {
-                    *(dstI + dstIntIndex) = cmidi2_ump_jr_timestamp_direct((uint32_t)(timestampTicks) % 62500); // 2 sec.
-                    timestampTicks -= 62500;
-                    dstIntIndex++;
-                } while (timestampTicks > 0);
-            }
-            // then generate UMP for the status byte
-            if (msg.isSysEx()) {
-                cmidi2_ump_sysex7_process(0, (void *) msg.getRawData(), handleSysex7, mbh);
-            } else if (msg.isMetaEvent()) {
-                // FIXME: we will transmit META events into some UMP which seems coming to the next UMP spec.
-                //  https://www.midi.org/midi-articles/details-about-midi-2-0-midi-ci-profiles-and-property-exchange
-            } else {
-                auto data = msg.getRawData();
-                *(dstI + dstIntIndex) = (uint32_t) cmidi2_ump_midi1_message(
-                        0, data[0], (uint8_t) msg.getChannel(), data[1], data[2]);
-                dstIntIndex++;
+        auto capacity = buffer->get_buffer_size(buffer, aap_midi_in_port) - (int32_t) sizeof(AAPMidiBufferHeader);
+        mbh->length = 0;
+        if (capacity > 0)
+            flushStagedParameterChanges(mbh, (size_t) capacity);
+
+        // Convert MidiBuffer into MIDI 2.0 UMP stream on the AAP port.
+        // Sample positions become delta JR timestamps, emitted only when the position moves.
+        // A JR tick (1/31250 sec.) is coarser than a sample, so the tick count is rounded up
+        // and the plugin (that rounds down) gets the event at the same sample or the next one.
+        cmidi2_ump_forge forge;
+        cmidi2_ump_forge_init(&forge, (cmidi2_ump*) (void*) ((uint8_t*) (mbh + 1) + mbh->length),
+                              capacity > (int32_t) mbh->length ? (size_t) capacity - mbh->length : 0);
+        int64_t lastTicks = 0;
+        // if the port buffer is full, the rest of the events are dropped.
+        juceaap_addMidiBufferAsUmp(&forge, midiMessages, sample_rate, true, &lastTicks);
+        if (all_notes_off_pending) {
+            auto ticks = ((int64_t) jmax(0, audioBuffer.getNumSamples() - 1) * CMIDI2_JR_TIMESTAMP_TICKS_PER_SECOND + sample_rate - 1) / sample_rate;
+            auto mark = forge.offset;
+            bool added = juceaap_addJRTimestamps(&forge, ticks - lastTicks);
+            for (uint8_t ch = 0; added && ch < 16; ch++) {
+                uint8_t allNotesOff[3]{(uint8_t) (0xB0 | ch), 123, 0};
+                added = juceaap_addMidi1EventAsUmp(&forge, allNotesOff, 3);
             }
+            // if it does not fit, it goes with the next block the plugin gets.
+            if (added)
+                all_notes_off_pending = false;
+            else
+                forge.offset = mark;
         }
-        mbh->length = dstIntIndex * sizeof(uint32_t);
+        mbh->length += (uint32_t) forge.offset;
         mbh->time_options = 0;
         for (int i = 0; i < 6; i++)
             mbh->reserved[i] = 0;
     }
-
-    // FIXME: RT unlock
 }
 
 void AndroidAudioPluginInstance::postProcessBuffers(AudioBuffer<float> &audioBuffer, MidiBuffer &midiMessages) {
-    // FIXME: RT lock
-
-    int n = native->getNumPorts();
     auto *buffer = native->getAudioPluginBuffer();
 
-    int juceOutputsAssigned = 0;
-    for (int i = 0; i < n; i++) {
-        auto port = native->getPort(i);
-        if (port->getPortDirection() != AAP_PORT_DIRECTION_OUTPUT)
-            continue;
-        if (port->getContentType() == AAP_CONTENT_TYPE_AUDIO && juceOutputsAssigned < audioBuffer.getNumChannels()) {
-            memcpy((void *) audioBuffer.getWritePointer(juceOutputsAssigned++), buffer->get_buffer(buffer, i), audioBuffer.getNumSamples() * sizeof(float));
-        }
-    }
+    auto numOutputs = jmin((int) audio_out_ports.size(), audioBuffer.getNumChannels());
+    for (int i = 0; i < numOutputs; i++)
+        memcpy((void *) audioBuffer.getWritePointer(i), buffer->get_buffer(buffer, audio_out_ports[(size_t) i]),
+               audioBuffer.getNumSamples() * sizeof(float));
 
     if (aap_midi_out_port >= 0) {
-        auto mbh = (AAPMidiBufferHeader*) buffer->get_buffer(buffer, aap_midi_out_port);
-        mbh->length = 0;
-        auto ump = (cmidi2_ump*) (mbh + 1);
-        cmidi2_midi_conversion_context context;
-        cmidi2_midi_conversion_context_initialize(&context);
-        context.ump = ump;
-        context.ump_num_bytes = mbh->length;
-        context.midi1 = midi_output_store;
-        // FIXME: in the future we support sample accurate outputs
-        context.skip_delta_time = false;
-        cmidi2_convert_ump_to_midi1(&context);
-        for (uint32_t midi1At = 0; midi1At < context.midi1_num_bytes; ) {
-            size_t size = cmidi2_midi1_get_message_size(midi_output_store + midi1At, context.midi1_num_bytes - midi1At);
-            midiMessages.addEvent(midi_output_store + midi1At, (int) size, 0);
-            midi1At += size;
-        }
+        // The plugin outputs replace the inputs, as JUCE expects from processBlock().
+        // They are copied rather than swapped, so that juce_midi_output always keeps the storage reserved at prepare.
+        decodeMidiOutput((AAPMidiBufferHeader*) buffer->get_buffer(buffer, aap_midi_out_port), audioBuffer.getNumSamples());
+        midiMessages.clear();
+        midiMessages.addEvents(juce_midi_output, 0, -1, 0);
     }
+}
 
-    // clean up room for the next JUCE parameter changes cycle
-    if (aap_midi_in_port >= 0)
-        ((AAPMidiBufferHeader *) buffer->get_buffer(buffer, aap_midi_in_port))->length = 0;
-
-    // FIXME: RT unlock
+void AndroidAudioPluginInstance::decodeMidiOutput(AAPMidiBufferHeader* mbh, int32_t numSamples) {
+    juce_midi_output.clear();
+    int64_t ticks = 0;
+    int32_t sample = 0;
+    uint8_t midi1[16];
+
+    CMIDI2_UMP_SEQUENCE_FOREACH(mbh + 1, mbh->length, iter) {
+        auto ump = (cmidi2_ump*) (void*) iter;
+        switch (cmidi2_ump_get_message_type(ump)) {
+            case CMIDI2_MESSAGE_TYPE_UTILITY:
+                if (cmidi2_ump_get_status_code(ump) != CMIDI2_UTILITY_STATUS_JR_TIMESTAMP)
+                    break;
+                // The plugin rounds its tick count down, so round the sample position up.
+                ticks += cmidi2_ump_get_jr_timestamp_timestamp(ump);
+                sample = (int32_t) ((ticks * sample_rate + CMIDI2_JR_TIMESTAMP_TICKS_PER_SECOND - 1) / CMIDI2_JR_TIMESTAMP_TICKS_PER_SECOND);
+                if (sample >= numSamples)
+                    sample = jmax(0, numSamples - 1);
+                break;
+            case CMIDI2_MESSAGE_TYPE_SYSEX7: {
+                // The size keeps counting past the accumulator, so that a sysex that does not fit
+                // is dropped at its end instead of being delivered truncated.
+                auto append = [this](uint8_t b) {
+                    if (midi_output_sysex_size < midi_output_sysex.size())
+                        midi_output_sysex[midi_output_sysex_size] = b;
+                    midi_output_sysex_size++;
+                };
+                auto status = cmidi2_ump_get_status_code(ump);
+                if (status == CMIDI2_SYSEX_IN_ONE_UMP || status == CMIDI2_SYSEX_START) {
+                    midi_output_sysex_size = 0;
+                    append(0xF0);
+                }
+                auto u64 = cmidi2_ump_read_uint64_bytes(ump);
+                for (uint8_t i = 0, n = cmidi2_ump_get_sysex7_num_bytes(ump); i < n; i++)
+                    append(cmidi2_ump_get_byte_from_uint64(u64, 2 + i));
+                if (status == CMIDI2_SYSEX_IN_ONE_UMP || status == CMIDI2_SYSEX_END) {
+                    append(0xF7);
+                    if (midi_output_sysex_size <= midi_output_sysex.size())
+                        juce_midi_output.addEvent(midi_output_sysex.data(), (int) midi_output_sysex_size, sample);
+                    midi_output_sysex_size = 0;
+                }
+                break;
+            }
+            case CMIDI2_MESSAGE_TYPE_SYSEX8_MDS: {
+                // AAP parameter changes come as sysex8. Other sysex8 messages have no MIDI 1.0 counterpart.
+                uint8_t group, channel, key, extra;
+                uint16_t parameterId;
+                uint32_t transportValue;
+                auto raw = (const uint32_t*) ump;
+                uint8_t statusKind;
+                uint32_t statusValue;
+                if (readStatusSysex8(raw, &statusKind, &statusValue)) {
+                    if (statusKind == 'L') {
+                        // the plugin also reports it after every prepare(); only a different value is worth applying.
+                        auto latency = (int32_t) jmin(statusValue, (uint32_t) INT32_MAX);
+                        if (plugin_latency_samples.exchange(latency, std::memory_order_relaxed) != latency)
+                            plugin_latency_changed.store(true, std::memory_order_release);
+                    }
+                    else if (statusKind == 'O')
+                        num_plugin_deadline_overruns.store(statusValue, std::memory_order_relaxed);
+                    else if (statusKind == 'T') {
+                        auto tail = statusValue == UINT32_MAX ? (int64_t) -1 : (int64_t) statusValue;
+                        plugin_tail_samples.store(tail, std::memory_order_relaxed);
+                        setIdleTail(tail);
+                    }
+                }
+                else if (aapReadMidi2ParameterSysex8(&group, &channel, &key, &extra, &parameterId, &transportValue,
+                                                raw[0], raw[1], raw[2], raw[3]))
+                    postPluginParameterChange(parameterId, transportValue);
+                break;
+            }
+            default: {
+                // A MIDI 2.0 message may turn into more than one MIDI 1.0 message (e.g. RPN to CCs).
+                auto size = (uint32_t) cmidi2_convert_single_ump_to_midi1(midi1, sizeof(midi1), ump);
+                for (uint32_t at = 0; at < size; ) {
+                    auto eventSize = cmidi2_midi1_get_message_size(midi1 + at, size - at);
+                    if (eventSize == 0)
+                        break;
+                    juce_midi_output.addEvent(midi1 + at, (int) eventSize, sample);
+                    at += eventSize;
+                }
+                break;
+            }
+        }
+    }
 }
 
 juce::AudioProcessor::BusesProperties AndroidAudioPluginInstance::createJuceBuses(aap::PluginInstance* native) {
@@ -236,18 +299,48 @@ juce::AudioProcessor::BusesProperties AndroidAudioPluginInstance::createJuceBuse
 
 AndroidAudioPluginInstance::AndroidAudioPluginInstance(aap::PluginInstance* nativePlugin)
         : juce::AudioPluginInstance(createJuceBuses(nativePlugin)), native(nativePlugin),
-          sample_rate(-1) {
+          sample_rate(-1), plugin_info(nativePlugin->getPluginInformation()) {
+    buildPortPlan();
+
+    auto numParameters = nativePlugin->getNumParameters();
+    auto numDirtyWords = (size_t) (numParameters + 63) / 64;
+    staged_parameter_values.reset(new std::atomic<float>[(size_t) numParameters]);
+    staged_parameter_dirty.reset(new std::atomic<uint64_t>[numDirtyWords]);
+    plugin_parameter_values.reset(new std::atomic<float>[(size_t) numParameters]);
+    plugin_parameter_dirty.reset(new std::atomic<uint64_t>[numDirtyWords]);
+    for (size_t w = 0; w < numDirtyWords; w++) {
+        staged_parameter_dirty[w].store(0, std::memory_order_relaxed);
+        plugin_parameter_dirty[w].store(0, std::memory_order_relaxed);
+    }
 
     // It is super awkward, but plugin parameter definition does not exist in juce::PluginInformation.
     // Only AudioProcessor.addParameter() works. So we handle them here.
-    for (int i = 0; i < nativePlugin->getNumParameters(); i++) {
+    for (int i = 0; i < numParameters; i++) {
         auto para = nativePlugin->getParameter(i);
+        staged_parameter_infos.emplace_back(para);
+        auto id = para->getId();
+        if (id >= 0 && id <= UINT16_MAX) {
+            if ((size_t) id >= parameter_index_by_id.size())
+                parameter_index_by_id.resize((size_t) id + 1, -1);
+            parameter_index_by_id[(size_t) id] = i;
+        }
 #if JUCEAAP_HOSTED_PARAMETER
         addHostedParameter(std::unique_ptr<AndroidAudioPluginParameter>(new AndroidAudioPluginParameter(i, this, para)));
 #else
         addParameter(new AndroidAudioPluginParameter(i, this, para));
 #endif
     }
+
+    // It comes after all the plugin parameters, so that their indices match the AAP ones.
+    bypass_parameter = new AudioParameterBool("aap-juce-bypass", "Bypass", false);
+#if JUCEAAP_HOSTED_PARAMETER
+    addHostedParameter(std::unique_ptr<AudioParameterBool>(bypass_parameter));
+#else
+    addParameter(bypass_parameter);
+#endif
+
+    if (needsTimer())
+        startTimerHz(PARAMETER_NOTIFICATION_HZ);
 }
 
 void AndroidAudioPluginParameter::valueChanged(float newValue) {
@@ -258,68 +351,604 @@ bool AndroidAudioPluginInstance::parameterValueChanged(AndroidAudioPluginParamet
 {
     int i = parameter->getAAPParameterId();
 
-    if(getNumParameters() <= i)
+    if((int) staged_parameter_infos.size() <= i)
         return false; // too early to reach here.
 
+    if (i == notifying_host_parameter.load(std::memory_order_relaxed))
+        return true; // it came from the plugin itself.
+
     // In AAP V2 protocol, parameters are sent over MIDI2 port as UMP.
-    auto *buffer = native->getAudioPluginBuffer();
     if (aap_midi_in_port < 0)
         return false; // there is no port that accepts parameter changes
-    if ((uint32_t) aap_midi_in_port >= buffer->num_ports(buffer))
-        return false; // buffer does not seem prepared yet
 
-    int32_t paramId = parameter->getAAPParameterId();
-    if (paramId > UINT16_MAX) {
+    if (i > UINT16_MAX) {
         aap::a_log_f(AAP_LOG_LEVEL_ERROR, AAP_JUCE_LOG_TAG,
-                     "Unsupported attempt to set parameter index %d which is > %d", paramId,
+                     "Unsupported attempt to set parameter index %d which is > %d", i,
                      UINT16_MAX);
         return false;
     }
 
-    // FIXME: RT lock
+    // Only stage it here; preProcessBuffers() writes it to the MIDI2 input port.
+    staged_parameter_values[(size_t) i].store(newValue, std::memory_order_relaxed);
+    staged_parameter_dirty[(size_t) i / 64].fetch_or((uint64_t) 1 << (i % 64), std::memory_order_release);
+
+    return true;
+}
 
-    auto mbh = (AAPMidiBufferHeader*) buffer->get_buffer(buffer, aap_midi_in_port);
-    uint32_t* dst = (uint32_t*) (void*) ((uint8_t*) buffer->get_buffer(buffer, aap_midi_in_port) + sizeof(AAPMidiBufferHeader) + mbh->length);
-    mbh->length += 16;
-    auto transportValue = aapParameterPlainToTransportUint32(parameter->impl->getMinimumValue(),
-                                                             parameter->impl->getMaximumValue(),
-                                                             newValue);
-    aapMidi2ParameterSysex8(dst, dst + 1, dst + 2, dst + 3, 0, 0, 0, 0, (uint16_t) paramId, transportValue);
+void AndroidAudioPluginInstance::postPluginParameterChange(uint16_t parameterId, uint32_t transportValue) {
+    if (parameterId >= parameter_index_by_id.size())
+        return;
+    auto index = parameter_index_by_id[parameterId];
+    if (index < 0)
+        return;
+    auto info = staged_parameter_infos[(size_t) index];
+    auto plainValue = aapParameterNormalizedToPlain(info->getMinimumValue(), info->getMaximumValue(),
+                                                    aapParameterUint32ToNormalized(transportValue));
+    plugin_parameter_values[(size_t) index].store((float) plainValue, std::memory_order_relaxed);
+    plugin_parameter_dirty[(size_t) index / 64].fetch_or((uint64_t) 1 << (index % 64), std::memory_order_release);
+}
 
-    // FIXME: RT unlock
+bool AndroidAudioPluginInstance::needsTimer() const {
+    return !staged_parameter_infos.empty() || aap_midi_out_port >= 0 || isHibernated() || resuming;
+}
 
-    return true;
+void AndroidAudioPluginInstance::timerCallback() {
+    if (resume_requested.load(std::memory_order_relaxed) &&
+        resume_requested.exchange(false, std::memory_order_acquire))
+        resumeAsync();
+
+    if (plugin_latency_changed.load(std::memory_order_relaxed) &&
+        plugin_latency_changed.exchange(false, std::memory_order_acquire)) {
+        auto latency = pipeline_latency_samples + plugin_latency_samples.load(std::memory_order_relaxed);
+        if (latency != getLatencySamples()) {
+            setLatencySamples(latency);
+            latency_to_compensate.store(latency, std::memory_order_relaxed);
+        }
+    }
+
+    auto& parameters = getParameters();
+    for (size_t w = 0, numWords = (staged_parameter_infos.size() + 63) / 64; w < numWords; w++) {
+        if (plugin_parameter_dirty[w].load(std::memory_order_relaxed) == 0)
+            continue;
+        auto bits = plugin_parameter_dirty[w].exchange(0, std::memory_order_acquire);
+        while (bits != 0) {
+            auto index = (int32_t) (w * 64) + __builtin_ctzll(bits);
+            bits &= bits - 1;
+            if (index >= parameters.size())
+                continue;
+            auto parameter = static_cast<AndroidAudioPluginParameter*>(parameters[index]);
+            auto plainValue = plugin_parameter_values[(size_t) index].load(std::memory_order_relaxed);
+            notifying_host_parameter.store(index, std::memory_order_relaxed);
+            parameter->setValueNotifyingHost(parameter->convertTo0to1(plainValue));
+            notifying_host_parameter.store(-1, std::memory_order_relaxed);
+        }
+    }
+}
+
+void AndroidAudioPluginInstance::flushStagedParameterChanges(AAPMidiBufferHeader* mbh, size_t capacity) {
+    auto numParameters = staged_parameter_infos.size();
+    for (size_t w = 0, numWords = (numParameters + 63) / 64; w < numWords; w++) {
+        if (staged_parameter_dirty[w].load(std::memory_order_relaxed) == 0)
+            continue;
+        // Clear the bits before reading the values, so that a change that races with us is
+        // either observed here or staged again for the next block.
+        auto bits = staged_parameter_dirty[w].exchange(0, std::memory_order_acquire);
+        while (bits != 0) {
+            if (mbh->length + 16 > capacity) {
+                // whatever does not fit is left for the next block.
+                staged_parameter_dirty[w].fetch_or(bits, std::memory_order_relaxed);
+                return;
+            }
+            auto bit = __builtin_ctzll(bits);
+            bits &= bits - 1;
+            auto index = w * 64 + (size_t) bit;
+            auto info = staged_parameter_infos[index];
+            auto transportValue = aapParameterPlainToTransportUint32(info->getMinimumValue(),
+                                                                     info->getMaximumValue(),
+                                                                     staged_parameter_values[index].load(std::memory_order_relaxed));
+            uint32_t* dst = (uint32_t*) (void*) ((uint8_t*) (mbh + 1) + mbh->length);
+            // the message carries the parameter ID, which is not necessarily the same as our index.
+            aapMidi2ParameterSysex8(dst, dst + 1, dst + 2, dst + 3, 0, 0, 0, 0, (uint16_t) info->getId(), transportValue);
+            mbh->length += 16;
+        }
+    }
+}
+
+void AndroidAudioPluginInstance::dropStagedParameterChanges() {
+    for (size_t w = 0, numWords = (staged_parameter_infos.size() + 63) / 64; w < numWords; w++)
+        staged_parameter_dirty[w].store(0, std::memory_order_relaxed);
 }
 
 void
 AndroidAudioPluginInstance::prepareToPlay(double sampleRate, int maximumExpectedSamplesPerBlock) {
     sample_rate = (int) sampleRate;
+    prepared_block_size = maximumExpectedSamplesPerBlock;
+    prepared = true;
+    if (native == nullptr)
+        return; // hibernated; the instance is prepared with these at resume.
+
+    // the worker must not be processing while the buffers are reallocated.
+    stopProcessWorker();
+    if (process_stalled.load()) {
+        aap::a_log_f(AAP_LOG_LEVEL_ERROR, AAP_JUCE_LOG_TAG, "%s is stuck in process(); it cannot be prepared again.",
+                     plugin_info->getPluginID().c_str());
+        return;
+    }
 
     native->prepare(maximumExpectedSamplesPerBlock, (int32_t) sampleRate);
 
+    buildPortPlan();
+
+    if (aap_midi_out_port >= 0) {
+        auto *buffer = native->getAudioPluginBuffer();
+        auto umpCapacity = buffer->get_buffer_size(buffer, aap_midi_out_port) - (int32_t) sizeof(AAPMidiBufferHeader);
+        if (umpCapacity > 0) {
+            // A UMP can expand to up to four MIDI 1.0 events, and each MidiBuffer event takes
+            // a 6-byte header, so reserve enough not to grow on the audio thread.
+            juce_midi_output.ensureSize((size_t) umpCapacity * 5);
+            // A sysex cannot be longer than what the whole port can carry (6 bytes per 8-byte UMP).
+            midi_output_sysex.resize((size_t) umpCapacity + 2);
+        }
+    }
+
+    if (process_fallback == ProcessFallback::FadeLastBlock)
+        last_good_output.setSize((int) audio_out_ports.size(), maximumExpectedSamplesPerBlock);
+    else
+        last_good_output.setSize(0, 0);
+    last_good_output_frames = 0;
+
+    // The plugin latency is the last one it reported; a new one comes with the first processed block.
+    pipeline_latency_samples = pipelined ? maximumExpectedSamplesPerBlock : 0;
+    if (pipelined) {
+        pipeline_output.setSize((int) audio_out_ports.size(), pipeline_latency_samples);
+        resetPipelineOutput();
+    }
+    else
+        pipeline_output.setSize(0, 0);
+    if (pipelined || process_watchdog) {
+        process_worker = std::make_unique<ProcessWorker>(native);
+        process_worker->start();
+    }
+    setLatencySamples(pipeline_latency_samples + plugin_latency_samples.load(std::memory_order_relaxed));
+
+    // The tail is queried here, not on the audio thread. A zero tail from aap-core usually means that the
+    // plugin does not report it, so it is not trusted; aap-juce plugins report theirs with the first block.
+    auto tailSeconds = getTailLengthSeconds();
+    setIdleTail(std::isfinite(tailSeconds) && tailSeconds > 0 ? (int64_t) std::ceil(tailSeconds * sampleRate) : -1);
+    idle_samples = 0;
+
+    // The delay line is allocated for more than the current latency, as the plugin reports its own
+    // latency only after the first processed block (and whenever it changes).
+    auto numDryChannels = (int) jmin(audio_in_ports.size(), audio_out_ports.size());
+    auto maxBypassDelay = jmax(getLatencySamples(), (int) (sampleRate * MAX_BYPASS_DELAY_SECONDS));
+    bypass_dry.setSize(numDryChannels, maximumExpectedSamplesPerBlock);
+    bypass_delay.setSize(numDryChannels, maxBypassDelay + maximumExpectedSamplesPerBlock);
+    latency_to_compensate.store(getLatencySamples(), std::memory_order_relaxed);
+    compensated_latency = -1;
+    updateLatencyCompensation();
+    bypass_state = BypassState::Active;
+    all_notes_off_pending = false;
+
+    native->activate();
+}
+
+class AndroidAudioPluginInstance::ProcessWorker : public juce::Thread {
+    aap::PluginInstance* native;
+    WaitableEvent start_event{};
+    std::atomic<bool> done{true};
+    std::atomic<int32_t> num_frames{0};
+    std::atomic<int64_t> timeout_nanoseconds{0};
+
+public:
+    explicit ProcessWorker(aap::PluginInstance* nativePlugin)
+            : Thread("AAP process"), native(nativePlugin) {
+    }
+
+    void start() {
+#if JUCE_VERSION >= 0x070003
+        startRealtimeThread(Thread::RealtimeOptions{});
+#else
+        startThread(9);
+#endif
+    }
+
+    // Returns false if the thread is still inside native->process() after the timeout.
+    // It is never killed, as that would leave the plugin client in an unknown state.
+    bool stop(int timeoutMilliseconds) {
+        signalThreadShouldExit();
+        start_event.signal();
+        return waitForThreadToExit(timeoutMilliseconds);
+    }
+
+    void kick(int32_t numFrames, int64_t timeoutInNanoseconds) {
+        num_frames.store(numFrames, std::memory_order_relaxed);
+        timeout_nanoseconds.store(timeoutInNanoseconds, std::memory_order_relaxed);
+        done.store(false, std::memory_order_relaxed);
+        start_event.signal();
+    }
+
+    // Polls the completion flag until the timeout, so that the audio thread never blocks on a lock.
+    bool waitForCompletion(int64_t timeoutNanoseconds) {
+        if (done.load(std::memory_order_acquire))
+            return true;
+        auto until = getMonotonicNanoseconds() + timeoutNanoseconds;
+        while (!done.load(std::memory_order_acquire)) {
+            if (getMonotonicNanoseconds() >= until)
+                return false;
+            Thread::yield();
+        }
+        return true;
+    }
+
+    void run() override {
+        while (!threadShouldExit()) {
+            start_event.wait(-1);
+            if (threadShouldExit())
+                break;
+            native->process(num_frames.load(std::memory_order_relaxed), timeout_nanoseconds.load(std::memory_order_relaxed));
+            done.store(true, std::memory_order_release);
+        }
+    }
+};
+
+void AndroidAudioPluginInstance::stopProcessWorker() {
+    if (process_worker == nullptr)
+        return;
+    if (process_worker->stop(PROCESS_WORKER_STOP_TIMEOUT_MILLISECONDS))
+        process_worker.reset();
+    else {
+        // Deleting a running juce::Thread would block (or kill it), so the worker is leaked, and so is
+        // the native instance whose buffers it still uses. The thread ends if the call ever returns.
+        aap::a_log_f(AAP_LOG_LEVEL_ERROR, AAP_JUCE_LOG_TAG, "%s did not return from process(); abandoning the instance.",
+                     plugin_info->getPluginID().c_str());
+        process_worker.release();
+        process_stalled.store(true);
+    }
+    process_call_pending = false;
+}
+
+void AndroidAudioPluginInstance::processBlockPipelined(AudioBuffer<float> &audioBuffer, MidiBuffer &midiMessages) {
+    auto numSamples = audioBuffer.getNumSamples();
+    auto deadline = getProcessDeadlineNanoseconds(numSamples);
+
+    // Once the previous block is done, the AAP buffers are ours until the next kick().
+    // If it is not done within the deadline, the worker still owns them; we try again next time.
+    if (process_call_pending && !process_worker->waitForCompletion(deadline)) {
+        num_process_overruns.fetch_add(1, std::memory_order_relaxed);
+        applyProcessFallback(audioBuffer, midiMessages);
+        return;
+    }
+
+    // This block goes to the input ports, then the outputs of the previous block come back.
+    // They are separate ports, so the order only matters for in-place JUCE channels.
+    preProcessBuffers(audioBuffer, midiMessages);
+    if (aap_midi_out_port >= 0)
+        midiMessages.clear(); // the plugin outputs replace the inputs, as JUCE expects from processBlock().
+    if (process_call_pending) {
+        pushPipelineOutput(pipeline_pending_frames);
+        if (aap_midi_out_port >= 0) {
+            auto *buffer = native->getAudioPluginBuffer();
+            decodeMidiOutput((AAPMidiBufferHeader*) buffer->get_buffer(buffer, aap_midi_out_port), pipeline_pending_frames);
+            // The events are as late as the audio. Those that would fall beyond this block are put at its end.
+            auto delay = pipeline_latency_samples - pipeline_pending_frames;
+            for (const auto metadata : juce_midi_output)
+                midiMessages.addEvent(metadata.data, metadata.numBytes, jmin(metadata.samplePosition + delay, numSamples - 1));
+        }
+    }
+    // The FIFO holds at least pipeline_latency_samples here, which is not less than numSamples.
+    popPipelineOutput(audioBuffer);
+    if (process_call_pending)
+        rememberLastGoodOutput(audioBuffer);
+
+    pipeline_pending_frames = numSamples;
+    process_call_pending = true;
+    process_worker->kick(numSamples, deadline);
+}
+
+void AndroidAudioPluginInstance::resetPipelineOutput() {
+    pipeline_output.clear();
+    pipeline_output_read = 0;
+    pipeline_output_count = pipeline_output.getNumSamples();
+}
+
+void AndroidAudioPluginInstance::pushPipelineOutput(int32_t numFrames) {
+    auto capacity = pipeline_output.getNumSamples();
+    // JUCE does not pass blocks longer than prepared. If a host does, whatever does not fit is dropped.
+    numFrames = jmin(numFrames, capacity - pipeline_output_count);
+    if (numFrames <= 0)
+        return;
+    auto *buffer = native->getAudioPluginBuffer();
+    auto write = (pipeline_output_read + pipeline_output_count) % capacity;
+    auto first = jmin(numFrames, capacity - write);
+    for (int ch = 0, n = pipeline_output.getNumChannels(); ch < n; ch++) {
+        auto src = (const float*) buffer->get_buffer(buffer, audio_out_ports[(size_t) ch]);
+        pipeline_output.copyFrom(ch, write, src, first);
+        if (first < numFrames)
+            pipeline_output.copyFrom(ch, 0, src + first, numFrames - first);
+    }
+    pipeline_output_count += numFrames;
+}
+
+void AndroidAudioPluginInstance::popPipelineOutput(AudioBuffer<float> &audioBuffer) {
+    auto capacity = pipeline_output.getNumSamples();
+    auto numFrames = jmin(audioBuffer.getNumSamples(), pipeline_output_count);
+    auto first = jmin(numFrames, capacity - pipeline_output_read);
+    auto numOutputs = jmin(pipeline_output.getNumChannels(), audioBuffer.getNumChannels());
+    for (int ch = 0; ch < numOutputs; ch++) {
+        audioBuffer.copyFrom(ch, 0, pipeline_output, ch, pipeline_output_read, first);
+        if (first < numFrames)
+            audioBuffer.copyFrom(ch, first, pipeline_output, ch, 0, numFrames - first);
+        if (numFrames < audioBuffer.getNumSamples())
+            audioBuffer.clear(ch, numFrames, audioBuffer.getNumSamples() - numFrames);
+    }
+    if (capacity > 0)
+        pipeline_output_read = (pipeline_output_read + numFrames) % capacity;
+    pipeline_output_count -= numFrames;
+}
+
+int64_t AndroidAudioPluginInstance::getProcessDeadlineNanoseconds(int32_t numFrames) const {
+    // The plugin must be done within its share of the block duration, and never take unreasonably long.
+    auto blockNanoseconds = sample_rate > 0 ? (int64_t) numFrames * 1000000000 / sample_rate : MAX_ACCEPTABLE_PROCESS_NANOSECCONDS;
+    return jmin((int64_t) ((double) blockNanoseconds * process_deadline_ratio), (int64_t) MAX_ACCEPTABLE_PROCESS_NANOSECCONDS);
+}
+
+void AndroidAudioPluginInstance::setIdleTail(int64_t tailSamples) {
+    // Instruments (no audio inputs) are never skipped, as their release after the last note-off
+    // is often not part of the tail they report. The latency is added as the output is delayed by it.
+    idle_tail_base_samples = audio_in_ports.empty() ? -1 : tailSamples;
+    idle_tail_samples = idle_tail_base_samples < 0 ? -1 : idle_tail_base_samples + jmax(0, compensated_latency);
+}
+
+bool AndroidAudioPluginInstance::isIdleBlock(const AudioBuffer<float> &audioBuffer, const MidiBuffer &midiMessages) {
+    if (!skip_idle_blocks || idle_tail_samples < 0)
+        return false;
+
+    bool active = all_notes_off_pending || !midiMessages.isEmpty();
+    for (size_t w = 0, numWords = (staged_parameter_infos.size() + 63) / 64; !active && w < numWords; w++)
+        active = staged_parameter_dirty[w].load(std::memory_order_relaxed) != 0;
+    auto numSamples = audioBuffer.getNumSamples();
+    for (int ch = 0, n = jmin((int) audio_in_ports.size(), audioBuffer.getNumChannels()); !active && ch < n; ch++) {
+        auto range = FloatVectorOperations::findMinAndMax(audioBuffer.getReadPointer(ch), numSamples);
+        active = range.getStart() < -IDLE_SILENCE_THRESHOLD || range.getEnd() > IDLE_SILENCE_THRESHOLD;
+    }
+
+    if (active) {
+        idle_samples = 0;
+        return false;
+    }
+    // the tail still has to be rendered by the plugin, until it has fully elapsed before this block.
+    bool idle = idle_samples > idle_tail_samples;
+    idle_samples += numSamples;
+    return idle;
+}
+
+void AndroidAudioPluginInstance::rememberLastGoodOutput(const AudioBuffer<float> &audioBuffer) {
+    if (last_good_output.getNumChannels() == 0)
+        return;
+    auto numFrames = jmin(audioBuffer.getNumSamples(), last_good_output.getNumSamples());
+    for (int ch = 0, n = jmin(audioBuffer.getNumChannels(), last_good_output.getNumChannels()); ch < n; ch++)
+        last_good_output.copyFrom(ch, 0, audioBuffer, ch, 0, numFrames);
+    last_good_output_frames = numFrames;
+}
+
+void AndroidAudioPluginInstance::applyProcessFallback(AudioBuffer<float> &audioBuffer, MidiBuffer &midiMessages) {
+    auto numSamples = audioBuffer.getNumSamples();
+    auto numOutputs = jmin((int) audio_out_ports.size(), audioBuffer.getNumChannels());
+    // the MIDI output buffer might be stale or partial.
+    if (aap_midi_out_port >= 0)
+        midiMessages.clear();
+
+    switch (process_fallback) {
+        case ProcessFallback::DryPassThrough:
+            // JUCE processes in place, so the inputs are still there; only the outputs without
+            // corresponding inputs need to be silenced.
+            for (int ch = (int) audio_in_ports.size(); ch < numOutputs; ch++)
+                audioBuffer.clear(ch, 0, numSamples);
+            break;
+        case ProcessFallback::FadeLastBlock:
+            if (last_good_output_frames > 0) {
+                auto numFrames = jmin(numSamples, last_good_output_frames);
+                for (int ch = 0; ch < numOutputs; ch++) {
+                    if (ch < last_good_output.getNumChannels()) {
+                        audioBuffer.copyFrom(ch, 0, last_good_output, ch, 0, numFrames);
+                        audioBuffer.applyGainRamp(ch, 0, numFrames, 1.0f, 0.0f);
+                    }
+                    else
+                        audioBuffer.clear(ch, 0, numFrames);
+                    audioBuffer.clear(ch, numFrames, numSamples - numFrames);
+                }
+                // fade only once; silence while it keeps overrunning.
+                last_good_output_frames = 0;
+                break;
+            }
+            [[fallthrough]];
+        case ProcessFallback::Silence:
+            for (int ch = 0; ch < numOutputs; ch++)
+                audioBuffer.clear(ch, 0, numSamples);
+            break;
+    }
+}
+
+void AndroidAudioPluginInstance::buildPortPlan() {
+    audio_in_ports.clear();
+    audio_out_ports.clear();
+    aap_midi_in_port = -1;
+    aap_midi_out_port = -1;
+    accepts_midi = false;
+    produces_midi = false;
+
     for (int i = 0, n = native->getNumPorts(); i < n; i++) {
         auto port = native->getPort(i);
-        if (port->getContentType() == AAP_CONTENT_TYPE_MIDI2) {
-            if (port->getPortDirection() == AAP_PORT_DIRECTION_INPUT)
-                aap_midi_in_port = i;
-            else
-                aap_midi_out_port = i;
+        bool isInput = port->getPortDirection() == AAP_PORT_DIRECTION_INPUT;
+        switch (port->getContentType()) {
+            case AAP_CONTENT_TYPE_AUDIO:
+                (isInput ? audio_in_ports : audio_out_ports).push_back(i);
+                break;
+            case AAP_CONTENT_TYPE_MIDI2:
+                if (isInput)
+                    aap_midi_in_port = i;
+                else
+                    aap_midi_out_port = i;
+                [[fallthrough]];
+            case AAP_CONTENT_TYPE_MIDI:
+                // "System MIDI" ports exist only for parameter changes, not for MIDI messages.
+                if (strstr(port->getName(), "System MIDI") == nullptr)
+                    (isInput ? accepts_midi : produces_midi) = true;
+                break;
+            default:
+                break;
         }
-
-        native->activate();
     }
 }
 
 void AndroidAudioPluginInstance::releaseResources() {
-    native->deactivate();
+    prepared = false;
+    if (native == nullptr)
+        return;
+    stopProcessWorker();
+    if (!process_stalled.load())
+        native->deactivate();
 }
 
 AndroidAudioPluginInstance::~AndroidAudioPluginInstance() {
+    alive->store(false);
+    stopTimer();
+    stopProcessWorker();
     // it does not dispose here; whatever allocated the instance (and passed to the constructor) is responsible.
-    native->deactivate();
+    if (native != nullptr && !process_stalled.load())
+        native->deactivate();
 }
 
-#define MAX_ACCEPTABLE_PROCESS_NANOSECCONDS 10000000 // I think it's fair to say that one plugin taking 10msec. is not appropriate...
+void AndroidAudioPluginInstance::setNativeInstanceLifecycle(NativeInstanceFactory factory,
+                                                            NativeInstanceDisposer disposer) {
+    native_factory = std::move(factory);
+    native_disposer = std::move(disposer);
+}
+
+bool AndroidAudioPluginInstance::hibernate() {
+    if (isHibernated() || resuming || !native_factory || !native_disposer)
+        return false;
+
+    // everything the proxy has to answer while hibernated is taken before the instance goes away.
+    getStateInformation(hibernated_state);
+    hibernated_tail_seconds = getTailLengthSeconds();
+    hibernated_preset_names.clear();
+    for (int i = 0, n = getNumPrograms(); i < n; i++)
+        hibernated_preset_names.add(getProgramName(i));
+    pending_preset_index = -1;
+    hibernated_num_inputs = (int) audio_in_ports.size();
+
+    // From here the audio thread only outputs silence; wait for a block that may still be running.
+    // processBlock() signals `block_finished` only while we wait, so blocks never take its lock otherwise.
+    block_finished.reset();
+    hibernate_waiting.store(true);
+    hibernated.store(true);
+    bool finished = !processing.load() || block_finished.wait(HIBERNATE_BLOCK_TIMEOUT_MILLISECONDS);
+    hibernate_waiting.store(false);
+    if (!finished) {
+        aap::a_log_f(AAP_LOG_LEVEL_WARN, AAP_JUCE_LOG_TAG, "%s did not finish its block in %d ms; it is not hibernated.",
+                     plugin_info->getPluginID().c_str(), HIBERNATE_BLOCK_TIMEOUT_MILLISECONDS);
+        hibernated.store(false);
+        hibernated_state.reset();
+        hibernated_preset_names.clear();
+        return false;
+    }
+
+    stopProcessWorker();
+    // A stalled instance is abandoned instead; the worker may still be inside it. Resuming creates a new one.
+    if (!process_stalled.load()) {
+        native->deactivate();
+        native_disposer(native);
+    }
+    native = nullptr;
+    resume_requested.store(false, std::memory_order_relaxed);
+    if (!isTimerRunning())
+        startTimerHz(PARAMETER_NOTIFICATION_HZ);
+    return true;
+}
+
+void AndroidAudioPluginInstance::resumeAsync(ResumeCallback onResumed) {
+    if (!isHibernated()) {
+        if (onResumed)
+            onResumed(true, {});
+        return;
+    }
+    if (onResumed)
+        resume_callbacks.emplace_back(std::move(onResumed));
+    if (resuming)
+        return;
+    resuming = true;
+
+    auto token = alive;
+    auto disposer = native_disposer;
+    native_factory([this, token, disposer](aap::PluginInstance* instance, std::string& error) {
+        String errorString{error};
+        MessageManager::callAsync([this, token, disposer, instance, errorString] {
+            if (!token->load()) {
+                // the proxy was deleted while the instance was being created.
+                if (instance != nullptr)
+                    disposer(instance);
+                return;
+            }
+            completeResume(instance, errorString);
+        });
+    });
+}
+
+void AndroidAudioPluginInstance::completeResume(aap::PluginInstance *instance, const String &error) {
+    resuming = false;
+    if (instance == nullptr) {
+        aap::a_log_f(AAP_LOG_LEVEL_ERROR, AAP_JUCE_LOG_TAG, "Could not resume %s: %s",
+                     plugin_info->getPluginID().c_str(), error.toRawUTF8());
+    } else {
+        // `hibernated` is still set, so the audio thread does not see any of this until it is done.
+        native = instance;
+        process_stalled.store(false);
+        // Parameter metadata belongs to the instance, so the old pointers are replaced.
+        auto& parameters = getParameters();
+        for (int i = 0, n = jmin((int) staged_parameter_infos.size(), native->getNumParameters()); i < n; i++) {
+            staged_parameter_infos[(size_t) i] = native->getParameter(i);
+            if (auto parameter = dynamic_cast<AndroidAudioPluginParameter*>(parameters[i]))
+                parameter->impl = staged_parameter_infos[(size_t) i];
+        }
+        if (prepared)
+            prepareToPlay(sample_rate, prepared_block_size);
+        // Parameter changes still staged here were made after this state was taken or set
+        // (setStateInformation() drops the older ones), so they are sent on top of it with the first block.
+        if (hibernated_state.getSize() > 0) {
+            aap_state_t state{hibernated_state.getData(), hibernated_state.getSize()};
+            native->getStandardExtensions().setState(state);
+        }
+        if (pending_preset_index >= 0)
+            native->getStandardExtensions().setCurrentPresetIndex(pending_preset_index);
+        hibernated_state.reset();
+        hibernated_preset_names.clear();
+        pending_preset_index = -1;
+        hibernated.store(false, std::memory_order_release);
+        if (!needsTimer())
+            stopTimer();
+    }
+
+    auto callbacks = std::move(resume_callbacks);
+    resume_callbacks.clear();
+    for (auto& callback : callbacks)
+        callback(instance != nullptr, error);
+}
+
+void AndroidAudioPluginInstance::processBlockHibernated(AudioBuffer<float> &audioBuffer, MidiBuffer &midiMessages) {
+    if (resume_on_activity && !resume_requested.load(std::memory_order_relaxed)) {
+        bool active = !midiMessages.isEmpty();
+        for (int ch = 0, n = jmin(hibernated_num_inputs, audioBuffer.getNumChannels()); !active && ch < n; ch++) {
+            auto range = FloatVectorOperations::findMinAndMax(audioBuffer.getReadPointer(ch), audioBuffer.getNumSamples());
+            active = range.getStart() < -IDLE_SILENCE_THRESHOLD || range.getEnd() > IDLE_SILENCE_THRESHOLD;
+        }
+        // timerCallback() starts resuming on the message thread.
+        if (active)
+            resume_requested.store(true, std::memory_order_release);
+    }
+    audioBuffer.clear();
+    midiMessages.clear();
+}
 
 int32_t n_warned{0};
 
@@ -328,6 +957,130 @@ const char *AAP_JUCE_DSP_TRACE_SECTION_NAME = "aap-juce:host:dsp-process";
 
 void AndroidAudioPluginInstance::processBlock(AudioBuffer<float> &audioBuffer,
                                               MidiBuffer &midiMessages) {
+    // `processing` is raised before `hibernated` is checked, so hibernate() can wait for this block.
+    // Lowering it and reading `hibernate_waiting` are sequentially consistent, so hibernate() cannot miss the signal.
+    processing.store(true);
+    if (hibernated.load())
+        processBlockHibernated(audioBuffer, midiMessages);
+    else
+        processBlockWithBypass(audioBuffer, midiMessages, bypass_parameter->get());
+    processing.store(false);
+    if (hibernate_waiting.load())
+        block_finished.signal();
+}
+
+void AndroidAudioPluginInstance::processBlockBypassed(AudioBuffer<float> &audioBuffer,
+                                                      MidiBuffer &midiMessages) {
+    processing.store(true);
+    if (hibernated.load())
+        processBlockHibernated(audioBuffer, midiMessages);
+    else
+        processBlockWithBypass(audioBuffer, midiMessages, true);
+    processing.store(false);
+    if (hibernate_waiting.load())
+        block_finished.signal();
+}
+
+void AndroidAudioPluginInstance::makeDryBlock(const AudioBuffer<float> &audioBuffer) {
+    auto numSamples = jmin(audioBuffer.getNumSamples(), bypass_dry.getNumSamples());
+    for (int ch = 0, n = jmin(bypass_dry.getNumChannels(), audioBuffer.getNumChannels()); ch < n; ch++) {
+        if (bypass_delay_samples == 0) {
+            bypass_dry.copyFrom(ch, 0, audioBuffer, ch, 0, numSamples);
+            continue;
+        }
+        // history + this block, then the oldest `numSamples` samples are the dry output,
+        // and the newest `bypass_delay_samples` samples are kept as the next history.
+        auto delay = bypass_delay.getWritePointer(ch);
+        FloatVectorOperations::copy(delay + bypass_delay_samples, audioBuffer.getReadPointer(ch), numSamples);
+        bypass_dry.copyFrom(ch, 0, delay, numSamples);
+        memmove(delay, delay + numSamples, (size_t) bypass_delay_samples * sizeof(float));
+    }
+}
+
+void AndroidAudioPluginInstance::writeDryBlock(AudioBuffer<float> &audioBuffer, float wetStartGain, float wetEndGain) {
+    auto numSamples = jmin(audioBuffer.getNumSamples(), bypass_dry.getNumSamples());
+    for (int ch = 0, n = jmin((int) audio_out_ports.size(), audioBuffer.getNumChannels()); ch < n; ch++) {
+        audioBuffer.applyGainRamp(ch, 0, numSamples, wetStartGain, wetEndGain);
+        if (ch < bypass_dry.getNumChannels())
+            audioBuffer.addFromWithRamp(ch, 0, bypass_dry.getReadPointer(ch), numSamples, 1.0f - wetStartGain, 1.0f - wetEndGain);
+    }
+}
+
+void AndroidAudioPluginInstance::updateLatencyCompensation() {
+    auto latency = latency_to_compensate.load(std::memory_order_relaxed);
+    if (latency == compensated_latency)
+        return;
+    compensated_latency = latency;
+    idle_tail_samples = idle_tail_base_samples < 0 ? -1 : idle_tail_base_samples + latency;
+    // A latency beyond the preallocated delay line is compensated only partially.
+    bypass_delay_samples = jmin(latency, jmax(0, bypass_delay.getNumSamples() - bypass_dry.getNumSamples()));
+    // The history starts over from silence; it is heard only while bypassed or crossfading.
+    bypass_delay.clear();
+}
+
+void AndroidAudioPluginInstance::processBlockWithBypass(AudioBuffer<float> &audioBuffer,
+                                                        MidiBuffer &midiMessages, bool bypassed) {
+    updateLatencyCompensation();
+    // The delay line has to keep up even while active, to have the history when bypass starts.
+    if (bypassed || bypass_state != BypassState::Active || bypass_delay_samples > 0)
+        makeDryBlock(audioBuffer);
+
+    switch (bypass_state) {
+        case BypassState::Active:
+            if (!bypassed) {
+                processBlockActive(audioBuffer, midiMessages);
+                return;
+            }
+            // the last block for the plugin; make sure that no note hangs when it resumes.
+            if (accepts_midi)
+                all_notes_off_pending = true;
+            processBlockActive(audioBuffer, midiMessages);
+            writeDryBlock(audioBuffer, 1.0f, 0.0f);
+            bypass_state = BypassState::Bypassed;
+            return;
+        case BypassState::Bypassed:
+            if (bypassed) {
+                // no remote processing at all; MIDI passes through.
+                writeDryBlock(audioBuffer, 0.0f, 0.0f);
+                return;
+            }
+            if (pipelined && process_worker != nullptr) {
+                // The pending result is from before the bypass. Drop it and prime the pipeline
+                // with this block, while the output stays dry. If that call is still running past
+                // the deadline, the output stays dry (as bypassed) and it is tried again next block.
+                if (process_call_pending &&
+                    !process_worker->waitForCompletion(getProcessDeadlineNanoseconds(audioBuffer.getNumSamples()))) {
+                    num_process_overruns.fetch_add(1, std::memory_order_relaxed);
+                    writeDryBlock(audioBuffer, 0.0f, 0.0f);
+                    return;
+                }
+                process_call_pending = false;
+                resetPipelineOutput();
+                processBlockActive(audioBuffer, midiMessages);
+                writeDryBlock(audioBuffer, 0.0f, 0.0f);
+                bypass_state = BypassState::Resuming;
+                return;
+            }
+            processBlockActive(audioBuffer, midiMessages);
+            writeDryBlock(audioBuffer, 0.0f, 1.0f);
+            bypass_state = BypassState::Active;
+            return;
+        case BypassState::Resuming:
+            if (bypassed) {
+                // the output was still dry; the primed block is dropped when it resumes again.
+                writeDryBlock(audioBuffer, 0.0f, 0.0f);
+                bypass_state = BypassState::Bypassed;
+                return;
+            }
+            processBlockActive(audioBuffer, midiMessages);
+            writeDryBlock(audioBuffer, 0.0f, 1.0f);
+            bypass_state = BypassState::Active;
+            return;
+    }
+}
+
+void AndroidAudioPluginInstance::processBlockActive(AudioBuffer<float> &audioBuffer,
+                                                    MidiBuffer &midiMessages) {
     struct timespec tsBegin, tsDspBegin, tsDspEnd, tsEnd;
 #if ANDROID
     if (ATrace_isEnabled()) {
@@ -335,6 +1088,40 @@ void AndroidAudioPluginInstance::processBlock(AudioBuffer<float> &audioBuffer,
         ATrace_beginSection(AAP_JUCE_TRACE_SECTION_NAME);
     }
 #endif
+    bool handled = true;
+    if (process_stalled.load(std::memory_order_relaxed))
+        applyProcessFallback(audioBuffer, midiMessages);
+    else if (pipelined && process_worker != nullptr)
+        processBlockPipelined(audioBuffer, midiMessages);
+    else if (isIdleBlock(audioBuffer, midiMessages)) {
+        for (int ch = 0, n = jmin((int) audio_out_ports.size(), audioBuffer.getNumChannels()); ch < n; ch++)
+            audioBuffer.clear(ch, 0, audioBuffer.getNumSamples());
+        num_skipped_blocks.fetch_add(1, std::memory_order_relaxed);
+    }
+    else
+        handled = false;
+    if (handled) {
+#if ANDROID
+        if (ATrace_isEnabled())
+            ATrace_endSection();
+#endif
+        return;
+    }
+
+    // A call that missed an earlier deadline may still own the AAP buffers. Its result is stale anyway.
+    if (process_call_pending) {
+        if (!process_worker->waitForCompletion(0)) {
+            num_process_overruns.fetch_add(1, std::memory_order_relaxed);
+            applyProcessFallback(audioBuffer, midiMessages);
+#if ANDROID
+            if (ATrace_isEnabled())
+                ATrace_endSection();
+#endif
+            return;
+        }
+        process_call_pending = false;
+    }
+
     preProcessBuffers(audioBuffer, midiMessages);
 
 #if ANDROID
@@ -343,7 +1130,22 @@ void AndroidAudioPluginInstance::processBlock(AudioBuffer<float> &audioBuffer,
         ATrace_beginSection(AAP_JUCE_DSP_TRACE_SECTION_NAME);
     }
 #endif
-    native->process(audioBuffer.getNumSamples(), 0);
+    auto deadline = getProcessDeadlineNanoseconds(audioBuffer.getNumSamples());
+    bool overrun, late = false;
+    if (process_worker == nullptr) {
+        // A late block is still complete, so it is used; it is only counted.
+        auto processBegin = getMonotonicNanoseconds();
+        native->process(audioBuffer.getNumSamples(), deadline);
+        late = getMonotonicNanoseconds() - processBegin > deadline;
+        overrun = false;
+    } else {
+        process_worker->kick(audioBuffer.getNumSamples(), deadline);
+        process_call_pending = true;
+        // If the plugin does not respond in time, we stop waiting; the call is left to the worker.
+        overrun = !process_worker->waitForCompletion(deadline);
+        if (!overrun)
+            process_call_pending = false;
+    }
 #if ANDROID
     if (ATrace_isEnabled()) {
         clock_gettime(CLOCK_REALTIME, &tsDspEnd);
@@ -353,7 +1155,15 @@ void AndroidAudioPluginInstance::processBlock(AudioBuffer<float> &audioBuffer,
     }
 #endif
 
-    postProcessBuffers(audioBuffer, midiMessages);
+    if (overrun) {
+        num_process_overruns.fetch_add(1, std::memory_order_relaxed);
+        applyProcessFallback(audioBuffer, midiMessages);
+    } else {
+        if (late)
+            num_process_overruns.fetch_add(1, std::memory_order_relaxed);
+        postProcessBuffers(audioBuffer, midiMessages);
+        rememberLastGoodOutput(audioBuffer);
+    }
 #if ANDROID
     if (ATrace_isEnabled()) {
         clock_gettime(CLOCK_REALTIME, &tsEnd);
@@ -364,17 +1174,8 @@ void AndroidAudioPluginInstance::processBlock(AudioBuffer<float> &audioBuffer,
 #endif
 }
 
-bool AndroidAudioPluginInstance::hasMidiPort(bool isInput) const {
-    for (int i = 0; i < native->getNumPorts(); i++) {
-        auto p = native->getPort(i);
-        if (p->getPortDirection() == (isInput ? AAP_PORT_DIRECTION_INPUT : AAP_PORT_DIRECTION_OUTPUT) &&
-            (p->getContentType() == AAP_CONTENT_TYPE_MIDI || p->getContentType() == AAP_CONTENT_TYPE_MIDI2) &&
-            strstr(p->getName(), "System MIDI") == nullptr)
-            return true;
-    }
-    return false;
-}
-
+#if ANDROID
+// Plugin UIs are Android Views (or WebViews), so editors exist only on Android.
 class AndroidAudioProcessorEditor : public AudioProcessorEditor {
 public:
     AndroidAudioProcessorEditor(AudioProcessor *audioProcessor)
@@ -546,14 +1347,15 @@ public:
 };
 
 bool AndroidAudioPluginInstance::hasEditor() const {
-    auto instance = (aap::RemotePluginInstance*) native;
-    auto info = instance->getPluginInformation();
+    auto info = plugin_info;
     if (info->getUiViewFactory().empty() && info->getUiWeb().empty())
             return false;
     return true;
 }
 
 AudioProcessorEditor *AndroidAudioPluginInstance::createEditor() {
+    if (native == nullptr)
+        return nullptr; // hibernated
     auto instance = (aap::RemotePluginInstance*) native;
     auto info = instance->getPluginInformation();
     if (info->getUiViewFactory().empty())
@@ -561,68 +1363,295 @@ AudioProcessorEditor *AndroidAudioPluginInstance::createEditor() {
     else
         return new AndroidNativeAudioProcessorEditor(this, instance);
 }
+#else
+bool AndroidAudioPluginInstance::hasEditor() const {
+    return false;
+}
+
+AudioProcessorEditor *AndroidAudioPluginInstance::createEditor() {
+    return nullptr;
+}
+#endif
 
 void AndroidAudioPluginInstance::fillInPluginDescription(PluginDescription &description) const {
-    fillPluginDescriptionFromNativeInstance(description, native);
+    if (native == nullptr)
+        fillPluginDescriptionFromNativeDescription(description, *plugin_info);
+    else
+        fillPluginDescriptionFromNativeInstance(description, native);
+}
+
+std::shared_ptr<AndroidAudioPluginFormat::PluginList> AndroidAudioPluginFormat::createPluginList() {
+    auto list = std::make_shared<PluginList>();
+    list->snapshot = std::make_shared<aap::PluginListSnapshot>(aap::PluginListSnapshot::queryServices());
+    for (int i = 0; i < list->snapshot->getNumPluginInformation(); i++) {
+        auto p = list->snapshot->getPluginInformation(i);
+        list->plugins_by_id[p->getPluginID()] = p;
+        auto& inPackage = list->plugins_by_package[p->getPluginPackageName()];
+        if (inPackage.empty())
+            list->plugin_packages.emplace_back(p->getPluginPackageName());
+        inPackage.emplace_back(p);
+
+        auto desc = std::make_unique<PluginDescription>();
+        fillPluginDescriptionFromNativeDescription(*desc, *p);
+        list->descs_by_id[p->getPluginID()] = std::move(desc);
+    }
+#if ANDROID
+    list->host = std::make_unique<aap::PluginClient>(plugin_client_connections, list->snapshot.get());
+#elif JUCEAAP_DESKTOP_HOSTING
+    list->host = std::make_unique<aap::PluginService>(list->snapshot.get());
+#endif
+    return list;
+}
+
+std::shared_ptr<AndroidAudioPluginFormat::PluginList> AndroidAudioPluginFormat::getPluginList() {
+    if (plugin_list_stale.load(std::memory_order_acquire)) {
+        const ScopedLock lock{plugin_list_lock};
+        if (plugin_list_stale.exchange(false, std::memory_order_acq_rel)) {
+            auto list = createPluginList();
+            {
+                const SpinLock::ScopedLockType swapLock{plugin_list_swap_lock};
+                std::swap(plugin_list, list);
+            }
+            // the old list goes away here (unless someone still holds it), outside the swap lock.
+        }
+    }
+    const SpinLock::ScopedLockType swapLock{plugin_list_swap_lock};
+    return plugin_list;
 }
 
-const aap::PluginInformation *
+bool AndroidAudioPluginFormat::pluginNeedsRescanning(const PluginDescription &description) {
+    auto list = getPluginList();
+    auto it = list->plugins_by_id.find(description.fileOrIdentifier.toStdString());
+    if (it == list->plugins_by_id.end())
+        return true;
+    // the package has been updated since the description was made.
+    auto info = it->second;
+    return description.version != String(info->getVersion()) ||
+        description.lastInfoUpdateTime != Time(info->getLastInfoUpdateTime());
+}
+
+void AndroidAudioPluginFormat::refreshPluginList() {
+    plugin_list_stale.store(true, std::memory_order_release);
+    getPluginList();
+}
+
+void AndroidAudioPluginFormat::invalidatePluginList() {
+    plugin_list_stale.store(true, std::memory_order_release);
+}
+
+std::shared_ptr<const aap::PluginInformation>
+AndroidAudioPluginFormat::findPluginInformationById(const std::string &pluginId) {
+    auto list = getPluginList();
+    auto it = list->plugins_by_id.find(pluginId);
+    // it shares the ownership of the list, so the information stays valid after a refresh.
+    return it != list->plugins_by_id.end() ? std::shared_ptr<const aap::PluginInformation>(list, it->second) : nullptr;
+}
+
+std::vector<std::shared_ptr<const aap::PluginInformation>>
+AndroidAudioPluginFormat::findPluginInformationByPackage(const std::string &packageName) {
+    auto list = getPluginList();
+    std::vector<std::shared_ptr<const aap::PluginInformation>> ret{};
+    auto it = list->plugins_by_package.find(packageName);
+    if (it != list->plugins_by_package.end())
+        for (auto p : it->second)
+            ret.emplace_back(list, p);
+    return ret;
+}
+
+std::shared_ptr<const aap::PluginInformation>
 AndroidAudioPluginFormat::findPluginInformationFrom(const PluginDescription &desc) {
-    auto list = aap::PluginListSnapshot::queryServices();
-    return list.getPluginInformation(desc.fileOrIdentifier.toRawUTF8());
+    return findPluginInformationById(desc.fileOrIdentifier.toStdString());
 }
 
 AndroidAudioPluginFormat::AndroidAudioPluginFormat() {
-    plugin_list_snapshot = aap::PluginListSnapshot::queryServices();
 #if ANDROID
     // FIXME: retrieve serviceConnectorInstanceId, not 0
     plugin_client_connections = aap::getPluginConnectionListByConnectorInstanceId(0, true);
-    android_host = std::make_unique<aap::PluginClient>(plugin_client_connections, &plugin_list_snapshot);
-    auto list = aap::PluginListSnapshot::queryServices();
-    for (int i = 0; i < list.getNumPluginInformation(); i++) {
-        auto d = list.getPluginInformation(i);
-        auto dst = new PluginDescription();
-        fillPluginDescriptionFromNativeDescription(*dst, *d);
-        cached_descs.set(d, dst);
-    }
 #else
-    // FIXME: desktop implementation is missing
+    // There are no services to bind to on desktop; plugins are loaded into this process.
+    plugin_client_connections = nullptr;
 #endif
+    plugin_list = createPluginList();
 }
 
-AndroidAudioPluginFormat::~AndroidAudioPluginFormat() {}
+AndroidAudioPluginFormat::~AndroidAudioPluginFormat() {
+    // Bind completions that arrive later (and hibernated instances that resume) see this and stop.
+    {
+        const ScopedLock lock{lifetime->lock};
+        lifetime->alive = false;
+    }
+    // Queued jobs are dropped. Running ones do not touch `this` once `alive` is cleared, so the
+    // timeout cannot leave them with a dangling format.
+    connection_pool.removeAllJobs(true, 5000);
+}
 
 void AndroidAudioPluginFormat::findAllTypesForFile(OwnedArray <PluginDescription> &results,
                                                    const String &fileOrIdentifier) {
     // For Android `fileOrIdentifier` is a service name, and for desktop it is a specific `aap_metadata.xml` file.
 #if ANDROID
-    auto id = fileOrIdentifier.toRawUTF8();
     // So far there is no way to perform query (without Java help) it is retrieved from cached list.
-    auto snapshot = aap::PluginListSnapshot::queryServices();
-    for (int i = 0; i < snapshot.getNumPluginInformation(); i++) {
-        auto p = snapshot.getPluginInformation(i);
-        if (strcmp(p->getPluginPackageName().c_str(), id) == 0) {
-            auto d = new PluginDescription();
-            juce_plugin_descs.add(d);
-            fillPluginDescriptionFromNativeCommon(*d, *p);
-            results.add(d);
+    // `results` owns what is added to it, so we hand out copies of the cached descriptions.
+    auto list = getPluginList();
+    auto it = list->plugins_by_package.find(fileOrIdentifier.toStdString());
+    if (it == list->plugins_by_package.end())
+        return;
+    for (auto p : it->second)
+        results.add(new PluginDescription(*list->descs_by_id[p->getPluginID()]));
+#elif JUCEAAP_DESKTOP_HOSTING
+    if (!fileMightContainThisPluginType(fileOrIdentifier))
+        return;
+    // The metadata only tells which plugins the file declares; their descriptions come from the
+    // shared list, which is refreshed once if the file declares a plugin it does not know yet.
+    std::vector<std::string> metadataPaths{fileOrIdentifier.toStdString()};
+    auto plugins = PluginClientSystem::getInstance()->getPluginsFromMetadataPaths(metadataPaths);
+    auto list = getPluginList();
+    for (auto p : plugins) {
+        if (list->plugins_by_id.find(p->getPluginID()) == list->plugins_by_id.end()) {
+            refreshPluginList();
+            list = getPluginList();
+            break;
         }
     }
-#else
-    auto metadataPath = fileOrIdentifier.toRawUTF8();
-    std::vector<PluginInformation*> plugins{};
-    aap::aap_parse_plugin_descriptor_into(nullptr, nullptr, metadataPath, plugins);
     for (auto p : plugins) {
-        auto dst = new PluginDescription();
-        juce_plugin_descs.add(dst); // to automatically free when disposing `this`.
-        fillPluginDescriptionFromNative(*dst, *p);
-        results.add(dst);
-        // FIXME: not sure if we should add it here. There is no ther timing to do this at desktop.
-        cached_descs.set(p, dst);
+        auto desc = list->descs_by_id.find(p->getPluginID());
+        if (desc != list->descs_by_id.end())
+            results.add(new PluginDescription(*desc->second));
+        else
+            aap::a_log_f(AAP_LOG_LEVEL_WARN, AAP_JUCE_LOG_TAG, "Plugin %s in %s is not in the plugin list",
+                         p->getPluginID().c_str(), fileOrIdentifier.toRawUTF8());
+        delete p;
+    }
+#endif
+}
+
+void AndroidAudioPluginFormat::connectPluginService(const aap::PluginInformation &pluginInfo,
+                                                    ConnectionCallback callback) {
+#if ANDROID
+    auto package = pluginInfo.getPluginPackageName();
+    if (plugin_client_connections->getServiceHandleForConnectedPlugin(package, pluginInfo.getPluginLocalName()) != nullptr) {
+        std::string error{};
+        callback(error);
+        return;
+    }
+    {
+        const ScopedLock lock{connection_lock};
+        auto& waiters = pending_connections[package];
+        waiters.emplace_back(std::move(callback));
+        if (waiters.size() > 1)
+            return; // the package is already being bound; just wait for it.
+    }
+    connection_pool.addJob([this, token = lifetime, connections = plugin_client_connections, package] {
+        {
+            const ScopedLock lock{token->lock};
+            if (!token->alive)
+                return;
+        }
+        // From here only the captures are used; the connection list belongs to the client system.
+        ConnectionCallback onConnected = [this, token, package](std::string& error) {
+            std::vector<ConnectionCallback> waiters{};
+            {
+                const ScopedLock aliveLock{token->lock};
+                if (!token->alive)
+                    return; // the format is gone, and so are the waiters.
+                const ScopedLock lock{connection_lock};
+                waiters = std::move(pending_connections[package]);
+                pending_connections.erase(package);
+            }
+            for (auto& waiter : waiters)
+                waiter(error);
+        };
+        PluginClientSystem::getInstance()->ensurePluginServiceConnected(connections, package, onConnected);
+    });
+#else
+    // in-process plugins need no connection.
+    std::string noError{};
+    callback(noError);
+#endif
+}
+
+aap::PluginInstance *
+AndroidAudioPluginFormat::createNativeInstance(PluginList &list, const std::string &identifier, double sampleRate, std::string &error) {
+#if ANDROID
+    auto result = list.host->createInstance(identifier, true);
+    if (!result.error.empty()) {
+        error = result.error;
+        return nullptr;
     }
+    return list.host->getInstanceById(result.value);
+#elif JUCEAAP_DESKTOP_HOSTING
+    auto instanceId = list.host->createInstance(identifier, (int) sampleRate);
+    auto instance = instanceId < 0 ? nullptr : list.host->getLocalInstance(instanceId);
+    if (instance == nullptr)
+        error = "Could not load plugin " + identifier + " into this process.";
+    return instance;
+#else
+    error = "Desktop hosting is experimental; build with JUCEAAP_EXPERIMENTAL_DESKTOP_HOSTING=1 to use it.";
+    return nullptr;
+#endif
+}
+
+void AndroidAudioPluginFormat::destroyNativeInstance(PluginList &list, aap::PluginInstance *instance) {
+#if ANDROID || JUCEAAP_DESKTOP_HOSTING
+    list.host->destroyInstance(instance);
 #endif
 }
 
+std::shared_ptr<AndroidAudioPluginFormat::PluginList>
+AndroidAudioPluginFormat::getPluginListIfAlive(AndroidAudioPluginFormat* format, Lifetime &token) {
+    const ScopedLock lock{token.lock};
+    return token.alive ? format->getPluginList() : nullptr;
+}
+
+std::unique_ptr<AndroidAudioPluginInstance>
+AndroidAudioPluginFormat::instantiateConnectedPlugin(AndroidAudioPluginFormat* format, std::shared_ptr<Lifetime> token,
+                                                     std::shared_ptr<PluginList> list, const std::string &identifier,
+                                                     double sampleRate, std::string &error) {
+    // This runs without the lifetime lock (createInstance() may block on the service), so `format`
+    // is only captured here, never dereferenced.
+    // The instance keeps the list it was created from (through the lifecycle functions), so that
+    // its PluginInformation and its host outlive any refresh.
+    auto native = createNativeInstance(*list, identifier, sampleRate, error);
+    if (native == nullptr)
+        return nullptr;
+    auto instance = std::make_unique<AndroidAudioPluginInstance>(native);
+    // Hibernation goes through the same binding and instantiation path as the first instance.
+    // Only binding and queuing happen under the lock; the instance is created on the pool.
+    instance->setNativeInstanceLifecycle(
+            [format, token, list, identifier, sampleRate](AndroidAudioPluginInstance::NativeInstanceCallback callback) {
+                const ScopedLock lock{token->lock};
+                if (!token->alive) {
+                    std::string gone{"The plugin format was destroyed."};
+                    callback(nullptr, gone);
+                    return;
+                }
+                auto pluginInfo = format->findPluginInformationById(identifier);
+                if (pluginInfo == nullptr) {
+                    std::string notFound{"Plugin " + identifier + " is not installed anymore."};
+                    callback(nullptr, notFound);
+                    return;
+                }
+                format->connectPluginService(*pluginInfo, [format, token, list, identifier, sampleRate, callback](std::string& connectError) {
+                    if (!connectError.empty()) {
+                        callback(nullptr, connectError);
+                        return;
+                    }
+                    const ScopedLock lock{token->lock};
+                    if (!token->alive) {
+                        std::string gone{"The plugin format was destroyed."};
+                        callback(nullptr, gone);
+                        return;
+                    }
+                    format->connection_pool.addJob([list, identifier, sampleRate, callback] {
+                        std::string createError{};
+                        auto recreated = createNativeInstance(*list, identifier, sampleRate, createError);
+                        callback(recreated, createError);
+                    });
+                });
+            },
+            [list](aap::PluginInstance* disposed) { destroyNativeInstance(*list, disposed); });
+    return instance;
+}
+
 void AndroidAudioPluginFormat::createPluginInstance(const PluginDescription &description,
                                                     double initialSampleRate,
                                                     int initialBufferSize,
@@ -635,46 +1664,88 @@ void AndroidAudioPluginFormat::createPluginInstance(const PluginDescription &des
     } else {
         // If the plugin service is not connected yet, then connect asynchronously with the callback
         // that processes instancing and invoke user callback (PluginCreationCallback).
-        std::function<void(int32_t,std::string&)> aapCallback = [this, callback](int32_t instanceID, std::string& error) {
-            auto androidInstance = android_host->getInstanceById(instanceID);
-
-            callback(std::make_unique<AndroidAudioPluginInstance>(androidInstance), error);
-        };
+        // An already connected service is instantiated right away.
         auto identifier = pluginInfo->getPluginID();
-        auto service = plugin_client_connections->getServiceHandleForConnectedPlugin(pluginInfo->getPluginPackageName(), pluginInfo->getPluginLocalName());
-        if (service != nullptr) {
-            auto result = android_host->createInstance(identifier, true);
-            aapCallback(result.value, result.error);
-        } else {
-            std::function<void(std::string&)> cb = [identifier,aapCallback,this](std::string& error) {
-                if (error.empty()) {
-                    auto result = android_host->createInstance(identifier, true);
-                    aapCallback(result.value, result.error);
-                }
+        connectPluginService(*pluginInfo, [this, token = lifetime, identifier, initialSampleRate, callback](std::string& error) {
+            std::unique_ptr<AndroidAudioPluginInstance> instance{};
+            if (error.empty()) {
+                auto list = getPluginListIfAlive(this, *token);
+                if (list != nullptr)
+                    instance = instantiateConnectedPlugin(this, token, list, identifier, initialSampleRate, error);
                 else
-                    aapCallback(-1, error);
-            };
-            // Make sure we launch a non-main thread
-            Thread::launch([this, pluginInfo, cb] {
-                PluginClientSystem::getInstance()->ensurePluginServiceConnected(plugin_client_connections, pluginInfo->getPluginPackageName(), cb);
-            });
+                    error = "The plugin format was destroyed.";
+            }
+            callback(std::move(instance), error);
+        });
+    }
+}
+
+void AndroidAudioPluginFormat::prewarmConnections(const Array<PluginDescription> &descriptions) {
+    for (auto& description : descriptions) {
+        auto pluginInfo = findPluginInformationFrom(description);
+        if (pluginInfo != nullptr)
+            connectPluginService(*pluginInfo, [](std::string&) {});
+    }
+}
+
+void AndroidAudioPluginFormat::createPluginInstances(const Array<PluginDescription> &descriptions,
+                                                     double initialSampleRate,
+                                                     int initialBufferSize,
+                                                     BatchCreationCallback callback) {
+    auto deliver = [callback](int index, std::unique_ptr<AudioPluginInstance> instance, String error) {
+        auto shared = std::make_shared<std::unique_ptr<AudioPluginInstance>>(std::move(instance));
+        MessageManager::callAsync([callback, index, shared, error] {
+            callback(index, std::move(*shared), error);
+        });
+    };
+
+    for (int i = 0; i < descriptions.size(); i++) {
+        auto& description = descriptions.getReference(i);
+        auto pluginInfo = findPluginInformationFrom(description);
+        if (pluginInfo == nullptr) {
+            String error("");
+            error << "Android Audio Plugin " << description.name << "was not found.";
+            deliver(i, nullptr, error);
+            continue;
         }
+        // Each package is bound at most once, and instances are created on the pool as soon as their
+        // package is ready, so that one slow service does not hold back the others.
+        auto identifier = pluginInfo->getPluginID();
+        connectPluginService(*pluginInfo, [this, token = lifetime, i, identifier, initialSampleRate, deliver](std::string& error) {
+            if (!error.empty()) {
+                deliver(i, nullptr, error);
+                return;
+            }
+            const ScopedLock lock{token->lock};
+            if (!token->alive) {
+                deliver(i, nullptr, "The plugin format was destroyed.");
+                return;
+            }
+            // The job gets everything it needs here, so it never touches `this`, even if the
+            // destructor gives up waiting for it.
+            connection_pool.addJob([format = this, token, list = getPluginList(), i, identifier, initialSampleRate, deliver] {
+                std::string createError{};
+                auto instance = instantiateConnectedPlugin(format, token, list, identifier, initialSampleRate, createError);
+                deliver(i, std::move(instance), createError);
+            });
+        });
     }
 }
 
 StringArray AndroidAudioPluginFormat::searchPathsForPlugins(const FileSearchPath &directoriesToSearch,
                                   bool recursive,
                                   bool allowPluginsWhichRequireAsynchronousInstantiation) {
-    std::vector<std::string> paths{};
     StringArray ret{};
-    auto list = aap::PluginListSnapshot::queryServices();
-    for (int i = 0; i < list.getNumPluginInformation(); i++) {
-        auto package = list.getPluginInformation(i)->getPluginPackageName();
-        if (!std::binary_search(paths.begin(), paths.end(), package))
-            paths.emplace_back(package);
-    }
-    for (auto p : paths)
+#if ANDROID
+    for (auto& p : getPluginList()->plugin_packages)
         ret.add(p);
+#elif JUCEAAP_DESKTOP_HOSTING
+    // Only the metadata files are returned, so nothing else under the plugin paths is ever parsed.
+    for (int i = 0; i < directoriesToSearch.getNumPaths(); i++) {
+        for (auto& file : directoriesToSearch[i].findChildFiles(File::findFiles, recursive, AAP_METADATA_FILE_NAME))
+            ret.addIfNotAlreadyThere(file.getFullPathName());
+    }
+#endif
     return ret;
 }
 
@@ -697,4 +1768,60 @@ FileSearchPath AndroidAudioPluginFormat::getDefaultLocationsToSearch() {
     return ret;
 }
 
+#if JUCE_UNIT_TESTS
+// It also works as a throughput benchmark of the host MIDI input encoding; see the logged events/sec.
+class JuceAAPMidiInputEncodingTest : public juce::UnitTest {
+public:
+    JuceAAPMidiInputEncodingTest() : juce::UnitTest("AAP host MIDI input encoding", "AAP") {}
+
+    void runTest() override {
+        const int32_t sampleRate = 48000;
+        const int32_t frameCount = 1024;
+        juce::MidiBuffer events;
+        for (int32_t i = 0; i < frameCount; i++)
+            events.addEvent(juce::MidiMessage::noteOn(1, 60 + i % 12, (uint8) 100), i);
+        // a JR timestamp and a MIDI1 UMP per event at most.
+        std::vector<uint32_t> words((size_t) frameCount * 2);
+
+        beginTest("Each event reaches the plugin at its own sample or the next one");
+        auto numWords = encode(events, sampleRate, words) / sizeof(uint32_t);
+        // decode as the plugin does: JR deltas are accumulated, and the ticks are rounded down to samples.
+        int64_t ticks = 0;
+        int32_t expectedSample = 0;
+        for (size_t i = 0; i < numWords; i++) {
+            auto ump = (const cmidi2_ump*) &words[i];
+            if (cmidi2_ump_get_message_type(ump) == CMIDI2_MESSAGE_TYPE_UTILITY) {
+                ticks += cmidi2_ump_get_jr_timestamp_timestamp(ump);
+                continue;
+            }
+            auto sample = (int32_t) (ticks * sampleRate / CMIDI2_JR_TIMESTAMP_TICKS_PER_SECOND);
+            expect(sample == expectedSample || sample == expectedSample + 1);
+            expectedSample++;
+        }
+        expectEquals(expectedSample, frameCount);
+
+        beginTest("Throughput");
+        const int iterations = 1000;
+        size_t totalBytes = 0;
+        auto start = juce::Time::getHighResolutionTicks();
+        for (int i = 0; i < iterations; i++)
+            totalBytes += encode(events, sampleRate, words);
+        auto seconds = juce::Time::highResolutionTicksToSeconds(juce::Time::getHighResolutionTicks() - start);
+        expectEquals((int64) totalBytes, (int64) (numWords * sizeof(uint32_t) * iterations));
+        logMessage(juce::String((double) frameCount * iterations / jmax(seconds, 1e-9) / 1000000.0, 2) + "M events/sec.");
+    }
+
+private:
+    static size_t encode(const juce::MidiBuffer& events, int32_t sampleRate, std::vector<uint32_t>& words) {
+        cmidi2_ump_forge forge;
+        cmidi2_ump_forge_init(&forge, (cmidi2_ump*) words.data(), words.size() * sizeof(uint32_t));
+        int64_t lastTicks = 0;
+        juceaap_addMidiBufferAsUmp(&forge, events, sampleRate, true, &lastTicks);
+        return forge.offset;
+    }
+};
+
+static JuceAAPMidiInputEncodingTest juceaap_midi_input_encoding_test;
+#endif
+
 } // namespace
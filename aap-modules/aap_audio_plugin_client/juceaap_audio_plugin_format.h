@@ -5,8 +5,19 @@
 #include <juce_gui_extra/juce_gui_extra.h>
 #include <aap/core/host/audio-plugin-host.h>
 #include <aap/core/host/plugin-client-system.h>
+#if ANDROID
 #include <aap/core/host/android/audio-plugin-host-android.h>
+#endif
 #include <aap/ext/midi.h>
+#include <unordered_map>
+
+// The desktop backend (plugins loaded into the host process through aap::PluginService) has not been
+// built and run against aap-core yet, so it is compiled only on request. Without it, desktop builds
+// find no plugins, as before.
+#ifndef JUCEAAP_EXPERIMENTAL_DESKTOP_HOSTING
+#define JUCEAAP_EXPERIMENTAL_DESKTOP_HOSTING 0
+#endif
+#define JUCEAAP_DESKTOP_HOSTING (!ANDROID && JUCEAAP_EXPERIMENTAL_DESKTOP_HOSTING)
 
 using namespace juce;
 
@@ -14,29 +25,194 @@ namespace juceaap {
 
 class AndroidAudioPluginParameter;
 
-class AndroidAudioPluginInstance : public juce::AudioPluginInstance {
+class AndroidAudioPluginInstance : public juce::AudioPluginInstance, private juce::Timer {
     friend class AndroidAudioPluginParameter;
 
     aap::PluginInstance *native;
     int32_t aap_midi_in_port{-1}, aap_midi_out_port{-1};
-    uint8_t midi_output_store[4096];
-    uint32_t midi_buffer_size{4096};
+    // MIDI outputs are decoded into this buffer (preallocated at prepareToPlay()), and then copied
+    // into the host's MidiBuffer, so that neither buffer loses its storage. Sysex7 packets are joined
+    // in midi_output_sysex.
+    MidiBuffer juce_midi_output{};
+    std::vector<uint8_t> midi_output_sysex{};
+    size_t midi_output_sysex_size{0};
     int sample_rate;
-    std::map<int32_t,int32_t> portMapAapToJuce{};
+    // Port plan, built from the port list at construction and rebuilt at prepareToPlay().
+    // The realtime path only touches these, never the aap::PortInformation list.
+    std::vector<int32_t> audio_in_ports{};
+    std::vector<int32_t> audio_out_ports{};
+    bool accepts_midi{false}, produces_midi{false};
+    void buildPortPlan();
+
+    // Parameter changes from whichever thread JUCE calls valueChanged() on. Each parameter has a
+    // last-value-wins slot and a bit in the dirty set, and preProcessBuffers() merges them into
+    // the MIDI2 input stream once per block, so a block carries at most one change per parameter.
+    std::unique_ptr<std::atomic<float>[]> staged_parameter_values{};
+    std::unique_ptr<std::atomic<uint64_t>[]> staged_parameter_dirty{};
+    std::vector<const aap::ParameterInformation*> staged_parameter_infos{};
+    void flushStagedParameterChanges(AAPMidiBufferHeader* mbh, size_t capacity);
+    // A restored state supersedes the parameter changes that are not sent to the plugin yet.
+    void dropStagedParameterChanges();
+
+    // Parameter changes that the plugin itself reports on its MIDI2 output (presets, its own UI, etc.).
+    // postProcessBuffers() posts them to these slots on the audio thread, and timerCallback() delivers
+    // them through setValueNotifyingHost() on the message thread, without echoing them back to the plugin.
+    std::unique_ptr<std::atomic<float>[]> plugin_parameter_values{};
+    std::unique_ptr<std::atomic<uint64_t>[]> plugin_parameter_dirty{};
+    std::vector<int32_t> parameter_index_by_id{};
+    std::atomic<int32_t> notifying_host_parameter{-1};
+    static constexpr int PARAMETER_NOTIFICATION_HZ = 30;
+    void postPluginParameterChange(uint16_t parameterId, uint32_t transportValue);
+
+    // The plugin latency, which aap-juce plugins report in-band on the MIDI2 output (see decodeMidiOutput()).
+    // It is applied with setLatencySamples() by timerCallback(), and remembered for the next prepareToPlay().
+    std::atomic<int32_t> plugin_latency_samples{0};
+    std::atomic<bool> plugin_latency_changed{false};
+    // The tail in samples that aap-juce plugins report in-band; -1 for an infinite tail.
+    static constexpr int64_t TAIL_UNREPORTED = -2;
+    std::atomic<int64_t> plugin_tail_samples{TAIL_UNREPORTED};
+    // The number of deadline overruns the plugin itself reported in-band (aap-juce plugins only).
+    std::atomic<uint32_t> num_plugin_deadline_overruns{0};
+    int32_t pipeline_latency_samples{0};
+    void timerCallback() override;
     void preProcessBuffers(AudioBuffer<float> &audioBuffer, MidiBuffer &midiMessages);
     void postProcessBuffers(AudioBuffer<float> &buffer, MidiBuffer &midiMessages);
+    void decodeMidiOutput(AAPMidiBufferHeader* mbh, int32_t numSamples);
 
     bool parameterValueChanged(AndroidAudioPluginParameter* parameter, float newValue);
 
+    // native->process() runs on the audio thread, unless pipelined processing or the process watchdog
+    // is enabled. Then it runs on a worker thread, and the audio thread polls for its completion
+    // (without locks) only until the deadline, so that a stalled or dead plugin service cannot block it.
+    // The AAP buffers are touched only between the worker's completion and the next kick, so
+    // one set of shared buffers is enough. process_call_pending is true while the worker owns them.
+    class ProcessWorker;
+    std::unique_ptr<ProcessWorker> process_worker{};
+    bool process_call_pending{false};
+    bool process_watchdog{false};
+    // Set when the worker did not return from native->process() even at teardown. The worker and the
+    // native instance are then abandoned as is, and the outputs are the fallback until a new instance.
+    std::atomic<bool> process_stalled{false};
+    void stopProcessWorker();
+
+    // Pipelined mode: the worker processes the current block while the host consumes the results
+    // of the previous block, at the cost of one block of latency.
+    // The results go through an output FIFO that starts with pipeline_latency_samples (the maximum
+    // block size) of silence, so the latency stays exactly that even when the block sizes vary.
+    bool pipelined{false};
+    int32_t pipeline_pending_frames{0};
+    AudioBuffer<float> pipeline_output{};
+    int32_t pipeline_output_read{0};
+    int32_t pipeline_output_count{0};
+    void processBlockPipelined(AudioBuffer<float> &audioBuffer, MidiBuffer &midiMessages);
+    void resetPipelineOutput();
+    void pushPipelineOutput(int32_t numFrames);
+    void popPipelineOutput(AudioBuffer<float> &audioBuffer);
+
+public:
+    // What processBlock() outputs instead of the plugin results when the plugin missed the deadline.
+    enum class ProcessFallback {
+        Silence,
+        DryPassThrough,
+        FadeLastBlock // the last good block faded out, then silence while it keeps overrunning.
+    };
+
+private:
+    ProcessFallback process_fallback{ProcessFallback::DryPassThrough};
+    std::atomic<int64_t> num_process_overruns{0};
+    double process_deadline_ratio{0.5};
+    AudioBuffer<float> last_good_output{};
+    int32_t last_good_output_frames{0};
+    int64_t getProcessDeadlineNanoseconds(int32_t numFrames) const;
+    void applyProcessFallback(AudioBuffer<float> &audioBuffer, MidiBuffer &midiMessages);
+    void rememberLastGoodOutput(const AudioBuffer<float> &audioBuffer);
+
+    // Idle skipping: once the inputs have been silent (and there was no MIDI or parameter change)
+    // for longer than the tail, blocks are not sent to the plugin and the outputs are just zeroed.
+    // The first non-silent block (or event) goes to the plugin again.
+    static constexpr float IDLE_SILENCE_THRESHOLD = 1.0e-6f; // -120dB
+    bool skip_idle_blocks{true};
+    int64_t idle_tail_samples{-1}; // -1 for an infinite tail
+    int64_t idle_tail_base_samples{-1}; // the tail without the latency; -1 for an infinite tail
+    int64_t idle_samples{0};
+    std::atomic<int64_t> num_skipped_blocks{0};
+    bool isIdleBlock(const AudioBuffer<float> &audioBuffer, const MidiBuffer &midiMessages);
+    void setIdleTail(int64_t tailSamples);
+
+    // Host-side bypass: while bypassed, native->process() is not called at all and the outputs are
+    // the (latency-compensated) dry inputs. Entering and leaving bypass crossfade over one block,
+    // and the block that enters bypass is the last one sent to the plugin, with "all notes off".
+    enum class BypassState {
+        Active,
+        Bypassed,
+        Resuming // pipelined mode only; the first block after bypass primes the pipeline.
+    };
+    AudioParameterBool* bypass_parameter{nullptr};
+    BypassState bypass_state{BypassState::Active};
+    AudioBuffer<float> bypass_dry{};
+    AudioBuffer<float> bypass_delay{}; // the last `bypass_delay_samples` input samples, then the current block
+    int32_t bypass_delay_samples{0};
+    // "All notes off" for the block that enters bypass. preProcessBuffers() writes it only to the
+    // plugin's MIDI input, as the host's MidiBuffer goes downstream as is when the plugin has no MIDI output.
+    bool all_notes_off_pending{false};
+    // The latency that the bypass delay line and the idle tail compensate for. timerCallback() publishes
+    // it whenever it applies a new latency, and the audio thread adopts it at the beginning of the next block.
+    std::atomic<int32_t> latency_to_compensate{0};
+    int32_t compensated_latency{-1};
+    void updateLatencyCompensation();
+    void processBlockActive(AudioBuffer<float> &audioBuffer, MidiBuffer &midiMessages);
+    void processBlockWithBypass(AudioBuffer<float> &audioBuffer, MidiBuffer &midiMessages, bool bypassed);
+    void makeDryBlock(const AudioBuffer<float> &audioBuffer);
+    void writeDryBlock(AudioBuffer<float> &audioBuffer, float wetStartGain, float wetEndGain);
+
     static juce::AudioProcessor::BusesProperties createJuceBuses(aap::PluginInstance* native);
 
+public:
+    // How the format recreates and disposes the native instance across hibernation.
+    // The factory may complete on any thread.
+    using NativeInstanceCallback = std::function<void(aap::PluginInstance* instance, std::string& error)>;
+    using NativeInstanceFactory = std::function<void(NativeInstanceCallback callback)>;
+    using NativeInstanceDisposer = std::function<void(aap::PluginInstance* instance)>;
+    using ResumeCallback = std::function<void(bool succeeded, const String& error)>;
+
+private:
+    // Hibernation: the native instance (and its remote processor and shared buffers) is disposed,
+    // and this object stays as a proxy that keeps the parameters, buses and the saved state.
+    // processBlock() outputs silence until resumeAsync() recreates the instance and restores the state.
+    // `hibernated` and `processing` make sure the audio thread never touches a disposed instance.
+    // It points into the plugin list that created the native instance, which native_disposer keeps alive.
+    const aap::PluginInformation* plugin_info;
+    NativeInstanceFactory native_factory{};
+    NativeInstanceDisposer native_disposer{};
+    std::atomic<bool> hibernated{false};
+    std::atomic<bool> processing{false};
+    // hibernate() waits on it for the block that was running when it set `hibernated`.
+    std::atomic<bool> hibernate_waiting{false};
+    juce::WaitableEvent block_finished{};
+    std::atomic<bool> resume_requested{false};
+    bool resume_on_activity{true};
+    bool resuming{false};
+    std::vector<ResumeCallback> resume_callbacks{};
+    std::shared_ptr<std::atomic<bool>> alive{std::make_shared<std::atomic<bool>>(true)};
+    bool prepared{false};
+    int prepared_block_size{0};
+    juce::MemoryBlock hibernated_state{};
+    double hibernated_tail_seconds{0};
+    StringArray hibernated_preset_names{};
+    // taken at hibernate(); the audio thread reads this instead of audio_in_ports, which resuming rebuilds.
+    int hibernated_num_inputs{0};
+    int pending_preset_index{-1};
+    void processBlockHibernated(AudioBuffer<float> &audioBuffer, MidiBuffer &midiMessages);
+    void completeResume(aap::PluginInstance* instance, const String& error);
+    bool needsTimer() const;
+
 public:
 
     AndroidAudioPluginInstance(aap::PluginInstance *nativePlugin);
     ~AndroidAudioPluginInstance() override;
 
     inline const String getName() const override {
-        return native->getPluginInformation()->getDisplayName();
+        return plugin_info->getDisplayName();
     }
 
     void prepareToPlay(double sampleRate, int maximumExpectedSamplesPerBlock) override;
@@ -45,9 +221,69 @@ public:
 
     void processBlock(AudioBuffer<float> &audioBuffer, MidiBuffer &midiMessages) override;
 
+    void processBlockBypassed(AudioBuffer<float> &audioBuffer, MidiBuffer &midiMessages) override;
+
+    inline AudioProcessorParameter* getBypassParameter() const override { return bypass_parameter; }
+
+    // Enables pipelined processing, which reports one extra block of latency (the maximum block size)
+    // through getLatencySamples(). It takes effect at the next prepareToPlay().
+    inline void setPipelinedProcessing(bool enabled) { pipelined = enabled; }
+    inline bool isPipelinedProcessing() const { return pipelined; }
+
+    // Enabled by default. Blocks are skipped only for plugins that take audio input and whose tail is known:
+    // aap-juce plugins report it in-band, and other plugins only when aap-core gives a positive tail.
+    // Disable it for effects that generate sound without any input.
+    inline void setSkipIdleBlocks(bool enabled) { skip_idle_blocks = enabled; }
+    inline bool getSkipIdleBlocks() const { return skip_idle_blocks; }
+    // The number of blocks that were not sent to the plugin because they were idle.
+    inline int64_t getNumSkippedBlocks() const { return num_skipped_blocks.load(std::memory_order_relaxed); }
+
+    // Disabled by default. When enabled, native->process() runs on a worker thread, and a block that
+    // is not done within the deadline is replaced by the fallback, at the cost of two thread switches
+    // per block. Without it, a late block is still used and only counted as an overrun.
+    // It takes effect at the next prepareToPlay().
+    inline void setProcessWatchdog(bool enabled) { process_watchdog = enabled; }
+    inline bool getProcessWatchdog() const { return process_watchdog; }
+
+    // What replaces a block that the watchdog (or pipelined processing) gave up on.
+    // DryPassThrough by default. FadeLastBlock needs its buffer allocated, so it takes effect at the next prepareToPlay().
+    inline void setProcessFallback(ProcessFallback fallback) { process_fallback = fallback; }
+    inline ProcessFallback getProcessFallback() const { return process_fallback; }
+    // The share of the block duration that native->process() may take before it counts as an overrun
+    // (and, with the watchdog, before the fallback is used). It is 0.5 by default so that the rest of
+    // the graph still has time to run.
+    inline void setProcessDeadlineRatio(double ratio) { process_deadline_ratio = jlimit(0.0, 1.0, ratio); }
+    inline double getProcessDeadlineRatio() const { return process_deadline_ratio; }
+    // The number of blocks where native->process() did not finish within the deadline.
+    inline int64_t getNumProcessOverruns() const { return num_process_overruns.load(std::memory_order_relaxed); }
+    // The number of process() calls where the plugin's own DSP exceeded the deadline, as reported by aap-juce plugins.
+    inline uint32_t getNumPluginDeadlineOverruns() const { return num_plugin_deadline_overruns.load(std::memory_order_relaxed); }
+
+    // Called by the format that created the instance. Without it the instance cannot hibernate.
+    void setNativeInstanceLifecycle(NativeInstanceFactory factory, NativeInstanceDisposer disposer);
+
+    // Saves the plugin state and disposes the native instance. Message thread only.
+    // Returns false if it is already hibernated, the instance cannot be recreated, or the block
+    // that the audio thread is processing does not finish in time (it stays active then).
+    bool hibernate();
+
+    // Recreates the native instance, prepares it as before and restores the saved state.
+    // Call it ahead of need (e.g. when the playhead approaches the track), as binding can take
+    // a while. `onResumed` is called on the message thread. Message thread only.
+    void resumeAsync(ResumeCallback onResumed = {});
+
+    inline bool isHibernated() const { return hibernated.load(std::memory_order_acquire); }
+
+    // When enabled (the default), audio or MIDI input arriving while hibernated starts resuming.
+    // That input itself is lost, so hosts that know ahead should call resumeAsync() instead.
+    inline void setResumeOnActivity(bool enabled) { resume_on_activity = enabled; }
+    inline bool getResumeOnActivity() const { return resume_on_activity; }
+
     double getTailLengthSeconds() const override;
 
-    bool hasMidiPort(bool isInput) const;
+    inline bool hasMidiPort(bool isInput) const {
+        return isInput ? accepts_midi : produces_midi;
+    }
 
     inline bool acceptsMidi() const override {
         return hasMidiPort(true);
@@ -62,6 +298,8 @@ public:
     inline bool hasEditor() const override;
 
     inline int getNumPrograms() override {
+        if (isHibernated())
+            return hibernated_preset_names.size();
         return native->getStandardExtensions().getPresetCount();
     }
 
@@ -71,10 +309,15 @@ public:
     }
 
     inline void setCurrentProgram(int index) override {
-        native->getStandardExtensions().setCurrentPresetIndex(index);
+        if (isHibernated())
+            pending_preset_index = index; // applied at resume, after the saved state.
+        else
+            native->getStandardExtensions().setCurrentPresetIndex(index);
     }
 
     inline const String getProgramName(int index) override {
+        if (isHibernated())
+            return hibernated_preset_names[index];
         return native->getStandardExtensions().getPresetName(index);
     }
 
@@ -86,6 +329,10 @@ public:
     }
 
     inline void getStateInformation(juce::MemoryBlock &destData) override {
+        if (isHibernated()) {
+            destData = hibernated_state;
+            return;
+        }
         auto result = native->getStandardExtensions().getState();
         if (result.error.empty()) {
             auto& state = result.value;
@@ -95,6 +342,12 @@ public:
     }
 
     inline void setStateInformation(const void *data, int sizeInBytes) override {
+        dropStagedParameterChanges();
+        if (isHibernated()) {
+            hibernated_state.replaceAll(data, (size_t) sizeInBytes);
+            pending_preset_index = -1;
+            return;
+        }
         aap_state_t state{const_cast<void *>(data), static_cast<size_t>(sizeInBytes)};
         native->getStandardExtensions().setState(state);
     }
@@ -124,19 +377,85 @@ public:
 };
 
 class AndroidAudioPluginFormat : public juce::AudioPluginFormat {
-    aap::PluginListSnapshot plugin_list_snapshot;
+    static constexpr const char* AAP_METADATA_FILE_NAME = "aap_metadata.xml";
+
+    // One plugin list snapshot, the indices built from it, and the host that instantiates plugins
+    // from it. A published list never changes. A refresh publishes a new one, and whatever still uses
+    // the old one (a lookup in progress, or the instances created from it) keeps it alive.
+    struct PluginList {
+        std::shared_ptr<aap::PluginListSnapshot> snapshot{};
+        std::unordered_map<std::string, const aap::PluginInformation*> plugins_by_id{};
+        std::unordered_map<std::string, std::vector<const aap::PluginInformation*>> plugins_by_package{};
+        std::vector<std::string> plugin_packages{}; // in snapshot order, without duplicates
+        std::unordered_map<std::string, std::unique_ptr<PluginDescription>> descs_by_id{};
+#if ANDROID
+        std::unique_ptr<aap::PluginClient> host{};
+#elif JUCEAAP_DESKTOP_HOSTING
+        // Desktop hosting loads plugins into this process, the same way a plugin service does on Android.
+        std::unique_ptr<aap::PluginService> host{};
+#endif
+    };
+
+    // The current list. It is queried at construction and then only when the host refreshes it
+    // (or invalidates it, e.g. on package install/removal). plugin_list_swap_lock is held only while
+    // the pointer is copied or swapped, and plugin_list_lock only keeps two refreshes from querying
+    // the services at the same time.
+    std::shared_ptr<PluginList> plugin_list{};
+    SpinLock plugin_list_swap_lock;
+    CriticalSection plugin_list_lock;
+    std::atomic<bool> plugin_list_stale{false};
     aap::PluginClientConnectionList* plugin_client_connections;
-    std::unique_ptr<aap::PluginClient> android_host;
-    OwnedArray<PluginDescription> juce_plugin_descs;
-    HashMap<const aap::PluginInformation *, PluginDescription *> cached_descs;
 
-    const aap::PluginInformation *findPluginInformationFrom(const PluginDescription &desc);
+    // Service binding is shared per package: callers asking for a package that is already being
+    // bound wait for that bind instead of starting another one.
+    using ConnectionCallback = std::function<void(std::string&)>;
+    static constexpr int MAX_CONCURRENT_SERVICE_BINDS = 4;
+    CriticalSection connection_lock;
+    std::unordered_map<std::string, std::vector<ConnectionCallback>> pending_connections{};
+    // Bind completions arrive on threads we do not own and cannot be canceled, and plugin instances
+    // may outlive the format. Whatever runs later holds this and touches the format only under its
+    // lock while `alive` is set; the destructor clears it. Nothing blocking (IPC) runs under the lock:
+    // the jobs take what they need (the plugin list) under it, and then work without `this`.
+    struct Lifetime {
+        CriticalSection lock;
+        bool alive{true};
+    };
+    std::shared_ptr<Lifetime> lifetime{std::make_shared<Lifetime>()};
+    // Declared last so that its jobs are gone before anything they use is destroyed.
+    ThreadPool connection_pool{MAX_CONCURRENT_SERVICE_BINDS};
+
+    void connectPluginService(const aap::PluginInformation& pluginInfo, ConnectionCallback callback);
+    static aap::PluginInstance* createNativeInstance(PluginList& list, const std::string& identifier, double sampleRate, std::string& error);
+    static void destroyNativeInstance(PluginList& list, aap::PluginInstance* instance);
+    static std::unique_ptr<AndroidAudioPluginInstance> instantiateConnectedPlugin(
+            AndroidAudioPluginFormat* format, std::shared_ptr<Lifetime> token, std::shared_ptr<PluginList> list,
+            const std::string& identifier, double sampleRate, std::string& error);
+    // nullptr once the format is destroyed. It is static, as `format` may already be gone.
+    static std::shared_ptr<PluginList> getPluginListIfAlive(AndroidAudioPluginFormat* format, Lifetime& token);
+
+    std::shared_ptr<PluginList> createPluginList();
+    std::shared_ptr<PluginList> getPluginList();
+
+    std::shared_ptr<const aap::PluginInformation> findPluginInformationFrom(const PluginDescription &desc);
 
 public:
     AndroidAudioPluginFormat();
 
     ~AndroidAudioPluginFormat() override;
 
+    // Re-queries the installed plugins and rebuilds the indices. Call it when a plugin
+    // package is installed or removed. What earlier lookups returned stays valid.
+    void refreshPluginList();
+
+    // Marks the snapshot stale so that the next lookup refreshes it. Unlike refreshPluginList()
+    // this is cheap, so it can be called directly from package change notifications.
+    void invalidatePluginList();
+
+    // O(1) lookups on the current snapshot. They return nullptr (or an empty list) when not found.
+    // The results keep their snapshot alive, so they outlive any refresh.
+    std::shared_ptr<const aap::PluginInformation> findPluginInformationById(const std::string& pluginId);
+    std::vector<std::shared_ptr<const aap::PluginInformation>> findPluginInformationByPackage(const std::string& packageName);
+
     inline String getName() const override {
         return "AAP";
     }
@@ -145,23 +464,30 @@ public:
                              const String &fileOrIdentifier) override;
 
     inline bool fileMightContainThisPluginType(const String &fileOrIdentifier) override {
-        // FIXME: limit to aap_metadata.xml ?
+#if ANDROID
+        // identifiers are package names, not files.
         return true;
+#else
+        return File::createFileWithoutCheckingPath(fileOrIdentifier).getFileName() == AAP_METADATA_FILE_NAME;
+#endif
     }
 
     inline String getNameOfPluginFromIdentifier(const String &fileOrIdentifier) override {
-        auto pluginInfo = aap::PluginListSnapshot::queryServices().getPluginInformation(fileOrIdentifier.toStdString());
+        auto pluginInfo = findPluginInformationById(fileOrIdentifier.toStdString());
+#if !ANDROID
+        // desktop scanning passes metadata files, which are named after their directory.
+        if (pluginInfo == nullptr && fileMightContainThisPluginType(fileOrIdentifier))
+            return File::createFileWithoutCheckingPath(fileOrIdentifier).getParentDirectory().getFileName();
+#endif
         return pluginInfo != nullptr ? String(pluginInfo->getDisplayName()) : String();
     }
 
-    inline bool pluginNeedsRescanning(const PluginDescription &description) override {
-        // This is not a concept for AAP. Android service information cannot be retrieved without querying.
-        return true;
-    }
+    // A plugin needs rescanning only when it is gone or its package was updated since the description
+    // was made (its version or last info update time differs from the plugin list snapshot).
+    bool pluginNeedsRescanning(const PluginDescription &description) override;
 
     inline bool doesPluginStillExist(const PluginDescription &description) override {
-        auto list = aap::PluginListSnapshot::queryServices();
-        return list.getPluginInformation(description.fileOrIdentifier.toRawUTF8()) != nullptr;
+        return findPluginInformationFrom(description) != nullptr;
     }
 
     inline bool canScanForPlugins() const override {
@@ -185,6 +511,20 @@ public:
                               int initialBufferSize,
                               PluginCreationCallback callback) override;
 
+    // Called once per description, on the message thread, in completion order.
+    using BatchCreationCallback = std::function<void(int index, std::unique_ptr<AudioPluginInstance> instance, const String& error)>;
+
+    // Instantiates a whole session at once. Every distinct plugin package is bound concurrently
+    // (at most MAX_CONCURRENT_SERVICE_BINDS at a time), and each instance is created as soon as
+    // its own package is ready, so the total time approaches that of the slowest bind.
+    void createPluginInstances(const Array<PluginDescription>& descriptions,
+                               double initialSampleRate,
+                               int initialBufferSize,
+                               BatchCreationCallback callback);
+
+    // Starts binding the packages of `descriptions` ahead of instantiation.
+    void prewarmConnections(const Array<PluginDescription>& descriptions);
+
 protected:
     inline bool requiresUnblockedMessageThreadDuringCreation(
             const PluginDescription &description) const noexcept override {
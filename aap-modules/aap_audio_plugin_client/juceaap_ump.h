@@ -0,0 +1,99 @@
+#pragma once
+
+// MIDI 1.0 (JUCE MidiBuffer) to UMP encoding, shared by the aap-juce host (juceaap_audio_plugin_format.cpp,
+// for the plugin input) and the aap-juce plugin wrapper (juceaap_AAPWrappers.cpp, for the plugin output).
+//
+// It replaces cmidi2_convert_midi1_to_ump() and its conversion context, which are not used:
+// - they convert a whole byte stream, while we need a JR timestamp between events and a rollback
+//   of the event that does not fit;
+// - this cmidi2.h keeps the input position through a uint8_t pointer (it wraps at 256 bytes) and
+//   writes MIDI1 UMPs through a byte pointer, so only MIDI2 UMP output would be usable;
+// - AAP ports carry MIDI1 UMPs, and the wrapper decodes them back to MIDI 1.0 bytes anyway.
+// The context that the conversion needs for MIDI1 UMPs is only the running status, kept by the caller.
+
+#include <cstdint>
+#include <juce_audio_basics/juce_audio_basics.h>
+#include "cmidi2.h"
+
+static inline bool juceaap_addJRTimestamps(cmidi2_ump_forge* forge, int64_t deltaTicks) {
+    // A JR timestamp can hold up to 0xFFFF ticks (~2 sec.), so longer deltas take multiple UMPs.
+    for (; deltaTicks > 0; deltaTicks -= 0xFFFF)
+        if (!cmidi2_ump_forge_add_packet_32(forge, cmidi2_ump_jr_timestamp_direct(
+                (uint16_t) (deltaTicks > 0xFFFF ? 0xFFFF : deltaTicks))))
+            return false;
+    return true;
+}
+
+// `runningStatus` is the last channel status byte (0 if none), which an event without a status byte
+// reuses as in MIDI 1.0 running status. It may be null when every event comes with its status byte.
+// Returns false if the forge ran out of space; the UMPs that did fit are left for the caller to roll back.
+static inline bool juceaap_addMidi1EventAsUmp(cmidi2_ump_forge* forge, const uint8_t* data, int32_t size,
+                                              uint8_t* runningStatus = nullptr) {
+    if (data[0] < 0x80) {
+        // without a running status, the data bytes mean nothing.
+        if (runningStatus == nullptr || *runningStatus == 0)
+            return true;
+        auto status = *runningStatus;
+        // program change and channel pressure take one data byte.
+        bool twoDataBytes = (status & 0xE0) != 0xC0;
+        return cmidi2_ump_forge_add_packet_32(forge, (uint32_t) cmidi2_ump_midi1_message(
+                0, status & 0xF0, status & 0xF,
+                data[0],
+                twoDataBytes && size > 1 ? data[1] : 0));
+    }
+    if (runningStatus != nullptr) {
+        // channel messages set the running status, and sysex and system common messages cancel it.
+        if (data[0] < 0xF0)
+            *runningStatus = data[0];
+        else if (data[0] < 0xF8)
+            *runningStatus = 0;
+    }
+    if (data[0] == 0xF0) {
+        // JUCE sysex messages include F0 and F7, while UMP sysex7 packets contain neither.
+        auto numBytes = (size_t) (data[size - 1] == 0xF7 ? size - 2 : size - 1);
+        auto numPackets = cmidi2_ump_sysex7_get_num_packets(numBytes);
+        for (size_t i = 0; i < numPackets; i++)
+            if (!cmidi2_ump_forge_add_packet_64(forge, cmidi2_ump_sysex7_get_packet_of(0, numBytes, data, (int32_t) i)))
+                return false;
+        return true;
+    }
+    if (data[0] == 0xFF && size > 1) {
+        // a JUCE meta event (a single 0xFF byte is System Reset).
+        // FIXME: we will transmit META events into some UMP which seems coming to the next UMP spec.
+        //  https://www.midi.org/midi-articles/details-about-midi-2-0-midi-ci-profiles-and-property-exchange
+        return true;
+    }
+    if (data[0] > 0xF0)
+        return cmidi2_ump_forge_add_packet_32(forge, (uint32_t) cmidi2_ump_system_message(
+                0, data[0],
+                size > 1 ? data[1] : 0,
+                size > 2 ? data[2] : 0));
+    return cmidi2_ump_forge_add_packet_32(forge, (uint32_t) cmidi2_ump_midi1_message(
+            0, data[0] & 0xF0, data[0] & 0xF,
+            size > 1 ? data[1] : 0,
+            size > 2 ? data[2] : 0));
+}
+
+// Writes the events as MIDI1 UMPs, each preceded by a delta JR timestamp when its position moves.
+// `lastTicks` is the JR position (in ticks from the block start) the forge is at, and it is updated
+// as events are written. The receiving side of the host input rounds ticks down to samples, and
+// the host rounds the plugin output up, so `roundTicksUp` is set for the host input only.
+// Returns false when the forge is full; the event that did not fit is not left partially written.
+static inline bool juceaap_addMidiBufferAsUmp(cmidi2_ump_forge* forge, const juce::MidiBuffer& events,
+                                              int32_t sampleRate, bool roundTicksUp, int64_t* lastTicks) {
+    auto rounding = roundTicksUp ? (int64_t) sampleRate - 1 : 0;
+    uint8_t runningStatus = 0;
+    for (const auto metadata : events) {
+        if (metadata.numBytes <= 0)
+            continue;
+        auto ticks = ((int64_t) metadata.samplePosition * CMIDI2_JR_TIMESTAMP_TICKS_PER_SECOND + rounding) / sampleRate;
+        auto mark = forge->offset;
+        if (!juceaap_addJRTimestamps(forge, ticks - *lastTicks) ||
+            !juceaap_addMidi1EventAsUmp(forge, metadata.data, metadata.numBytes, &runningStatus)) {
+            forge->offset = mark;
+            return false;
+        }
+        *lastTicks = ticks;
+    }
+    return true;
+}
@@ -1,6 +1,9 @@
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
 #include <ctime>
-#include <mutex>
 #include <juce_audio_processors/juce_audio_processors.h>
 #include "aap/android-audio-plugin.h"
 #include "aap/core/host/plugin-host.h"
@@ -12,6 +15,7 @@
 #include "aap/ext/plugin-info.h"
 #include "aap/ext/gui.h"
 #include "cmidi2.h"
+#include "juceaap_ump.h"
 
 #if ANDROID
 #include <dlfcn.h>
@@ -89,6 +93,380 @@ extern "C" { int juce_aap_wrapper_last_error_code{0}; }
 #define JUCEAAP_ERROR_PROCESS_BUFFER_ALTERED -2
 #define JUCEAAP_ERROR_CHANNEL_IN_OUT_NUM_MISMATCH -3
 
+// What process() does when the JUCE processor exceeded the process deadline (timeoutInNanoseconds)
+// JUCEAAP_PROCESS_DEADLINE_MAX_CONSECUTIVE_OVERRUNS times in a row. Overruns are always counted and
+// reported to the host (see juceaap_statusSysex8()); the other policies also replace the next block
+// (without running processBlock()) with silence or with the last block that met the deadline.
+#define JUCEAAP_PROCESS_DEADLINE_POLICY_REPORT 0
+#define JUCEAAP_PROCESS_DEADLINE_POLICY_SILENCE 1
+#define JUCEAAP_PROCESS_DEADLINE_POLICY_LAST_GOOD_BLOCK 2
+#ifndef JUCEAAP_PROCESS_DEADLINE_POLICY
+#define JUCEAAP_PROCESS_DEADLINE_POLICY JUCEAAP_PROCESS_DEADLINE_POLICY_REPORT
+#endif
+#ifndef JUCEAAP_PROCESS_DEADLINE_MAX_CONSECUTIVE_OVERRUNS
+#define JUCEAAP_PROCESS_DEADLINE_MAX_CONSECUTIVE_OVERRUNS 3
+#endif
+
+// It can be defined in each plugin project, to shed optional work (voices, oversampling, etc.)
+// when processBlock() keeps missing the deadline. It is called on the audio thread.
+extern void juceaap_onProcessDeadlineExceeded(juce::AudioProcessor* processor,
+                                              int64_t elapsedNanoseconds,
+                                              int64_t deadlineNanoseconds,
+                                              int32_t consecutiveOverruns) __attribute__((weak));
+
+// When it is enabled, parameter changes that come with JR timestamps are applied at their
+// sample positions, by splitting processBlock() into slices at those positions.
+// Changes closer than JUCEAAP_PARAMETER_SLICE_MIN_FRAMES to the previous slice boundary
+// (or to the end of the block) are applied at that boundary instead.
+#ifndef JUCEAAP_SAMPLE_ACCURATE_PARAMETERS
+#define JUCEAAP_SAMPLE_ACCURATE_PARAMETERS 0
+#endif
+#ifndef JUCEAAP_PARAMETER_SLICE_MIN_FRAMES
+#define JUCEAAP_PARAMETER_SLICE_MIN_FRAMES 32
+#endif
+
+// AAP has no extension for the plugin status, so it is sent to the host in-band, as one SysEx8 packet
+// on the MIDI2 output port: stream 0, non-commercial manufacturer ID 0x7D, 'J', the kind, then the value
+// as big-endian uint32. The kinds are:
+// - JUCEAAP_STATUS_LATENCY: the latency in samples, after prepare() and whenever it changes.
+// - JUCEAAP_STATUS_DEADLINE_OVERRUNS: the number of process() calls that exceeded the deadline so far,
+//   whenever it changes.
+// - JUCEAAP_STATUS_TAIL: the tail (getTailLengthSeconds()) in samples, UINT32_MAX for an infinite tail,
+//   after prepare() and whenever it changes. The host skips idle blocks only after the tail has elapsed.
+// juceaap_audio_plugin_format.cpp (the aap-juce host) decodes them. Nothing is sent while the values
+// stay the same, so other hosts see these packets only at prepare() and on actual changes.
+#define JUCEAAP_STATUS_LATENCY 'L'
+#define JUCEAAP_STATUS_DEADLINE_OVERRUNS 'O'
+#define JUCEAAP_STATUS_TAIL 'T'
+static inline void juceaap_statusSysex8(uint32_t* dst, uint8_t kind, uint32_t value) {
+    dst[0] = 0x50000000 | (8 << 16) | 0x7D; // SysEx8, group 0, complete in one UMP, 8 bytes, stream 0
+    dst[1] = ('J' << 24) | (kind << 16) | ((value >> 24) << 8) | ((value >> 16) & 0xFF);
+    dst[2] = ((value >> 8) & 0xFF) << 24 | (value & 0xFF) << 16;
+    dst[3] = 0;
+}
+
+// Fields that different threads write to are kept on separate cache lines of this size.
+#ifndef JUCEAAP_CACHE_LINE_SIZE
+#define JUCEAAP_CACHE_LINE_SIZE 64
+#endif
+
+// Outgoing parameter changes, from whichever thread JUCE notifies us on, to the AAP MIDI2 output port.
+//
+// Each parameter index has its own slot where the last value wins. An index is pushed to the ring
+// only when its slot turns dirty, so the ring never holds more than one entry per parameter and
+// a preallocated ring of (at least) the parameter count never overflows.
+// push() is wait-free and does not allocate. drain() must be called only from one consumer thread.
+class JuceAAPParameterChangeQueue {
+    struct Slot {
+        std::atomic<float> value{0};
+        std::atomic<bool> dirty{false};
+    };
+
+    std::unique_ptr<Slot[]> slots{};
+    std::unique_ptr<std::atomic<uint32_t>[]> ring{}; // parameter index + 1, or 0 for an unpublished entry
+    uint32_t num_slots{0};
+    uint32_t ring_mask{0};
+    // the producer and the consumer positions must not share a cache line.
+    alignas(JUCEAAP_CACHE_LINE_SIZE) std::atomic<uint32_t> write_position{0};
+    alignas(JUCEAAP_CACHE_LINE_SIZE) uint32_t read_position{0};
+
+public:
+    void allocate(uint32_t numParameters) {
+        uint32_t capacity = 1;
+        while (capacity < numParameters)
+            capacity <<= 1;
+        slots.reset(new Slot[numParameters]);
+        ring.reset(new std::atomic<uint32_t>[capacity]);
+        for (uint32_t i = 0; i < capacity; i++)
+            ring[i].store(0, std::memory_order_relaxed);
+        num_slots = numParameters;
+        ring_mask = capacity - 1;
+        write_position.store(0, std::memory_order_relaxed);
+        read_position = 0;
+    }
+
+    bool push(uint32_t index, float value) {
+        if (index >= num_slots)
+            return false;
+        auto& slot = slots[index];
+        slot.value.store(value, std::memory_order_relaxed);
+        if (!slot.dirty.exchange(true, std::memory_order_acq_rel)) {
+            auto position = write_position.fetch_add(1, std::memory_order_relaxed);
+            ring[position & ring_mask].store(index + 1, std::memory_order_release);
+        }
+        return true;
+    }
+
+    // Invokes `fn(index, value)` for up to `maxCount` changed parameters, in the order they became dirty.
+    // An entry whose producer has not published it yet is left for the next call.
+    template <typename Fn>
+    uint32_t drain(uint32_t maxCount, Fn&& fn) {
+        uint32_t count = 0;
+        for (; count < maxCount; count++) {
+            auto& entry = ring[read_position & ring_mask];
+            auto stored = entry.load(std::memory_order_acquire);
+            if (stored == 0)
+                break;
+            entry.store(0, std::memory_order_release);
+            read_position++;
+
+            auto& slot = slots[stored - 1];
+            // Clear the flag before reading the value, so that a change that races with us is
+            // either observed here or pushed again for the next block.
+            slot.dirty.exchange(false, std::memory_order_acq_rel);
+            fn(stored - 1, slot.value.load(std::memory_order_relaxed));
+        }
+        return count;
+    }
+};
+
+// MIDI 2.0 channel voice messages to MIDI 1.0 events, as JUCE processors only take MIDI 1.0.
+// Messages without a MIDI 1.0 equivalent (per-note controllers, per-note pitch bend and management,
+// relative RPN/NRPN) are dropped. The events are written to a MidiBuffer preallocated by the caller.
+class JuceAAPMidi2ChannelDecoder {
+public:
+    typedef void (*Decoder)(const cmidi2_ump* ump, juce::MidiBuffer& dst, int32_t sample);
+
+    static void decode(const cmidi2_ump* ump, juce::MidiBuffer& dst, int32_t sample) {
+        auto decoder = getDecoders()[cmidi2_ump_get_status_code(ump) >> 4];
+        if (decoder != nullptr)
+            decoder(ump, dst, sample);
+    }
+
+private:
+    static const Decoder* getDecoders() {
+        // indexed by (status >> 4), and filled by status code so that a slot cannot drift from cmidi2.
+        static const auto decoders = [] {
+            std::array<Decoder, 16> d{};
+            d[CMIDI2_STATUS_RPN >> 4] = decodeRpn;
+            d[CMIDI2_STATUS_NRPN >> 4] = decodeNrpn;
+            d[CMIDI2_STATUS_NOTE_OFF >> 4] = decodeNote;
+            d[CMIDI2_STATUS_NOTE_ON >> 4] = decodeNote;
+            d[CMIDI2_STATUS_PAF >> 4] = decodePaf;
+            d[CMIDI2_STATUS_CC >> 4] = decodeCc;
+            d[CMIDI2_STATUS_PROGRAM >> 4] = decodeProgram;
+            d[CMIDI2_STATUS_CAF >> 4] = decodeCaf;
+            d[CMIDI2_STATUS_PITCH_BEND >> 4] = decodePitchBend;
+            return d;
+        }();
+        return decoders.data();
+    }
+
+    static inline void addMidi1Event(juce::MidiBuffer& dst, int32_t sample, uint8_t status, uint8_t data1, uint8_t data2) {
+        const uint8_t bytes[3]{status, data1, data2};
+        // JUCE trims the event to the actual length that the status byte implies.
+        dst.addEvent(bytes, 3, sample);
+    }
+
+    static void addMidi1ControlChanges(juce::MidiBuffer& dst, int32_t sample, uint8_t channel,
+                                       uint8_t msbIndex, uint8_t msb, uint8_t lsbIndex, uint8_t lsb, uint32_t data) {
+        addMidi1Event(dst, sample, CMIDI2_STATUS_CC + channel, msbIndex, msb);
+        addMidi1Event(dst, sample, CMIDI2_STATUS_CC + channel, lsbIndex, lsb);
+        addMidi1Event(dst, sample, CMIDI2_STATUS_CC + channel, CMIDI2_CC_DTE_MSB, (uint8_t) (data >> 25) & 0x7F);
+        addMidi1Event(dst, sample, CMIDI2_STATUS_CC + channel, CMIDI2_CC_DTE_LSB, (uint8_t) (data >> 18) & 0x7F);
+    }
+
+    static void decodeRpn(const cmidi2_ump* ump, juce::MidiBuffer& dst, int32_t sample) {
+        addMidi1ControlChanges(dst, sample, cmidi2_ump_get_channel(ump),
+                               CMIDI2_CC_RPN_MSB, cmidi2_ump_get_midi2_rpn_msb(ump),
+                               CMIDI2_CC_RPN_LSB, cmidi2_ump_get_midi2_rpn_lsb(ump),
+                               cmidi2_ump_get_midi2_rpn_data(ump));
+    }
+
+    static void decodeNrpn(const cmidi2_ump* ump, juce::MidiBuffer& dst, int32_t sample) {
+        addMidi1ControlChanges(dst, sample, cmidi2_ump_get_channel(ump),
+                               CMIDI2_CC_NRPN_MSB, cmidi2_ump_get_midi2_nrpn_msb(ump),
+                               CMIDI2_CC_NRPN_LSB, cmidi2_ump_get_midi2_nrpn_lsb(ump),
+                               cmidi2_ump_get_midi2_nrpn_data(ump));
+    }
+
+    static void decodeNote(const cmidi2_ump* ump, juce::MidiBuffer& dst, int32_t sample) {
+        auto velocity16 = cmidi2_ump_get_midi2_note_velocity(ump);
+        auto velocity7 = static_cast<uint8_t>(velocity16 / 0x200);
+        auto statusByte = cmidi2_ump_get_status_byte(ump);
+        addMidi1Event(dst, sample, statusByte,
+                      cmidi2_ump_get_midi2_note_note(ump),
+                      (statusByte & 0xF0) == CMIDI2_STATUS_NOTE_ON && velocity16 > 0 && velocity7 == 0
+                              ? static_cast<uint8_t>(1)
+                              : velocity7);
+    }
+
+    static void decodePaf(const cmidi2_ump* ump, juce::MidiBuffer& dst, int32_t sample) {
+        addMidi1Event(dst, sample, cmidi2_ump_get_status_byte(ump),
+                      cmidi2_ump_get_midi2_note_note(ump),
+                      (uint8_t) (cmidi2_ump_get_midi2_paf_data(ump) / 0x2000000));
+    }
+
+    static void decodeCc(const cmidi2_ump* ump, juce::MidiBuffer& dst, int32_t sample) {
+        addMidi1Event(dst, sample, cmidi2_ump_get_status_byte(ump),
+                      cmidi2_ump_get_midi2_cc_index(ump),
+                      (uint8_t) (cmidi2_ump_get_midi2_cc_data(ump) / 0x2000000));
+    }
+
+    static void decodeProgram(const cmidi2_ump* ump, juce::MidiBuffer& dst, int32_t sample) {
+        auto channel = cmidi2_ump_get_channel(ump);
+        if (cmidi2_ump_get_midi2_program_options(ump) & CMIDI2_PROGRAM_CHANGE_OPTION_BANK_VALID) {
+            addMidi1Event(dst, sample, CMIDI2_STATUS_CC + channel, CMIDI2_CC_BANK_SELECT, cmidi2_ump_get_midi2_program_bank_msb(ump));
+            addMidi1Event(dst, sample, CMIDI2_STATUS_CC + channel, CMIDI2_CC_BANK_SELECT_LSB, cmidi2_ump_get_midi2_program_bank_lsb(ump));
+        }
+        addMidi1Event(dst, sample, cmidi2_ump_get_status_byte(ump), cmidi2_ump_get_midi2_program_program(ump), 0);
+    }
+
+    static void decodeCaf(const cmidi2_ump* ump, juce::MidiBuffer& dst, int32_t sample) {
+        addMidi1Event(dst, sample, cmidi2_ump_get_status_byte(ump),
+                      (uint8_t) (cmidi2_ump_get_midi2_caf_data(ump) / 0x2000000), 0);
+    }
+
+    static void decodePitchBend(const cmidi2_ump* ump, juce::MidiBuffer& dst, int32_t sample) {
+        auto data = cmidi2_ump_get_midi2_pitch_bend_data(ump);
+        addMidi1Event(dst, sample, cmidi2_ump_get_status_byte(ump),
+                      (uint8_t) (data >> 18) & 0x7F,
+                      (uint8_t) (data >> 25) & 0x7F);
+    }
+};
+
+#if JUCE_UNIT_TESTS
+class JuceAAPMidi2ChannelDecoderTest : public juce::UnitTest {
+public:
+    JuceAAPMidi2ChannelDecoderTest() : juce::UnitTest("AAP MIDI 2.0 channel message decoding", "AAP") {}
+
+    void runTest() override {
+        // 0x12345678 as a 14-bit data entry value is MSB 0x09, LSB 0x0D.
+        beginTest("RPN turns into RPN and data entry control changes");
+        expectControlChanges(decode(cmidi2_ump_midi2_rpn(0, 2, 0x01, 0x05, 0x12345678)), 2,
+                             {CMIDI2_CC_RPN_MSB, 0x01, CMIDI2_CC_RPN_LSB, 0x05,
+                              CMIDI2_CC_DTE_MSB, 0x09, CMIDI2_CC_DTE_LSB, 0x0D});
+
+        beginTest("NRPN turns into NRPN and data entry control changes");
+        expectControlChanges(decode(cmidi2_ump_midi2_nrpn(0, 9, 0x10, 0x20, 0x12345678)), 9,
+                             {CMIDI2_CC_NRPN_MSB, 0x10, CMIDI2_CC_NRPN_LSB, 0x20,
+                              CMIDI2_CC_DTE_MSB, 0x09, CMIDI2_CC_DTE_LSB, 0x0D});
+
+        beginTest("Per-note registered controllers have no MIDI 1.0 equivalent");
+        expect(decode(cmidi2_ump_midi2_per_note_rcc(0, 0, 60, 0x01, 0x12345678)).isEmpty());
+    }
+
+private:
+    static juce::MidiBuffer decode(int64_t ump) {
+        const uint32_t words[2]{(uint32_t) ((uint64_t) ump >> 32), (uint32_t) ump};
+        juce::MidiBuffer result;
+        JuceAAPMidi2ChannelDecoder::decode((const cmidi2_ump*) words, result, 0);
+        return result;
+    }
+
+    // `expected` is a list of (controller number, value) pairs.
+    void expectControlChanges(const juce::MidiBuffer& events, int channel, std::initializer_list<int> expected) {
+        std::vector<int> actual{};
+        for (const auto metadata : events) {
+            auto message = metadata.getMessage();
+            expect(message.isController());
+            expectEquals(message.getChannel(), channel + 1);
+            actual.push_back(message.getControllerNumber());
+            actual.push_back(message.getControllerValue());
+        }
+        expect(actual == std::vector<int>(expected));
+    }
+};
+
+static JuceAAPMidi2ChannelDecoderTest juceaap_midi2_channel_decoder_test;
+
+class JuceAAPMidi1ToUmpTest : public juce::UnitTest {
+public:
+    JuceAAPMidi1ToUmpTest() : juce::UnitTest("AAP MIDI 1.0 to UMP encoding", "AAP") {}
+
+    void runTest() override {
+        beginTest("Sysex is split into sysex7 packets of up to 6 bytes");
+        {
+            const uint8_t sysex[]{0xF0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 0xF7};
+            Encoder e;
+            expect(juceaap_addMidi1EventAsUmp(&e.forge, sysex, sizeof(sysex)));
+            expectEquals((int) e.forge.offset, 3 * 8);
+            expectSysex7(e.words, 0, CMIDI2_SYSEX_START, {1, 2, 3, 4, 5, 6});
+            expectSysex7(e.words, 2, CMIDI2_SYSEX_CONTINUE, {7, 8, 9, 10, 11, 12});
+            expectSysex7(e.words, 4, CMIDI2_SYSEX_END, {13});
+        }
+
+        beginTest("Short sysex fits in one packet");
+        {
+            const uint8_t sysex[]{0xF0, 0x7D, 0x01, 0xF7};
+            Encoder e;
+            expect(juceaap_addMidi1EventAsUmp(&e.forge, sysex, sizeof(sysex)));
+            expectEquals((int) e.forge.offset, 8);
+            expectSysex7(e.words, 0, CMIDI2_SYSEX_IN_ONE_UMP, {0x7D, 0x01});
+        }
+
+        beginTest("Sysex that does not fit reports it");
+        {
+            const uint8_t sysex[]{0xF0, 1, 2, 3, 4, 5, 6, 7, 0xF7};
+            Encoder e{3};
+            expect(!juceaap_addMidi1EventAsUmp(&e.forge, sysex, sizeof(sysex)));
+        }
+
+        beginTest("Running status reuses the last channel status");
+        {
+            const uint8_t noteOn[]{0x91, 60, 100};
+            const uint8_t nextNote[]{62, 90};
+            const uint8_t clock[]{0xF8};
+            const uint8_t program[]{0xC2, 5};
+            const uint8_t nextProgram[]{6, 127};
+            Encoder e;
+            uint8_t runningStatus = 0;
+            expect(juceaap_addMidi1EventAsUmp(&e.forge, noteOn, sizeof(noteOn), &runningStatus));
+            expect(juceaap_addMidi1EventAsUmp(&e.forge, nextNote, sizeof(nextNote), &runningStatus));
+            // realtime messages do not cancel it.
+            expect(juceaap_addMidi1EventAsUmp(&e.forge, clock, sizeof(clock), &runningStatus));
+            expect(juceaap_addMidi1EventAsUmp(&e.forge, nextNote, sizeof(nextNote), &runningStatus));
+            expect(juceaap_addMidi1EventAsUmp(&e.forge, program, sizeof(program), &runningStatus));
+            expect(juceaap_addMidi1EventAsUmp(&e.forge, nextProgram, sizeof(nextProgram), &runningStatus));
+            expectEquals((int) e.forge.offset, 6 * 4);
+            expectMidi1(e.words[1], 0x91, 62, 90);
+            expectMidi1(e.words[2], 0xF8, 0, 0);
+            expectMidi1(e.words[3], 0x91, 62, 90);
+            expectMidi1(e.words[5], 0xC2, 6, 0);
+        }
+
+        beginTest("Sysex cancels running status");
+        {
+            const uint8_t noteOn[]{0x90, 60, 100};
+            const uint8_t sysex[]{0xF0, 0x7D, 0xF7};
+            const uint8_t nextNote[]{62, 90};
+            Encoder e;
+            uint8_t runningStatus = 0;
+            expect(juceaap_addMidi1EventAsUmp(&e.forge, noteOn, sizeof(noteOn), &runningStatus));
+            expect(juceaap_addMidi1EventAsUmp(&e.forge, sysex, sizeof(sysex), &runningStatus));
+            expect(juceaap_addMidi1EventAsUmp(&e.forge, nextNote, sizeof(nextNote), &runningStatus));
+            expectEquals((int) e.forge.offset, 4 + 8);
+        }
+    }
+
+private:
+    struct Encoder {
+        uint32_t words[16]{};
+        cmidi2_ump_forge forge;
+        explicit Encoder(size_t numWords = 16) { cmidi2_ump_forge_init(&forge, (cmidi2_ump*) words, numWords * sizeof(uint32_t)); }
+    };
+
+    void expectSysex7(const uint32_t* words, size_t at, uint8_t status, std::initializer_list<int> bytes) {
+        auto ump = (const cmidi2_ump*) (words + at);
+        expectEquals((int) cmidi2_ump_get_message_type(ump), (int) CMIDI2_MESSAGE_TYPE_SYSEX7);
+        expectEquals((int) cmidi2_ump_get_status_code(ump), (int) status);
+        expectEquals((int) cmidi2_ump_get_sysex7_num_bytes(ump), (int) bytes.size());
+        auto packet = cmidi2_ump_read_uint64_bytes(ump);
+        uint8_t i = 0;
+        for (auto expected : bytes)
+            expectEquals((int) cmidi2_ump_get_byte_from_uint64(packet, 2 + i++), expected);
+    }
+
+    void expectMidi1(uint32_t word, int status, int byte2, int byte3) {
+        expectEquals((int) ((word >> 16) & 0xFF), status);
+        expectEquals((int) ((word >> 8) & 0xFF), byte2);
+        expectEquals((int) (word & 0xFF), byte3);
+    }
+};
+
+static JuceAAPMidi1ToUmpTest juceaap_midi1_to_ump_test;
+#endif
+
 // JUCE-AAP port mappings:
 //
 // 	JUCE AudioBuffer 0..nOut-1 -> AAP output ports 0..nOut-1
@@ -96,36 +474,133 @@ extern "C" { int juce_aap_wrapper_last_error_code{0}; }
 //  IF exists JUCE MIDI input buffer -> AAP MIDI input port nIn+nOut
 //  IF exists JUCE MIDI output buffer -> AAP MIDI output port last
 
-class JuceAAPWrapper : juce::AudioPlayHead, juce::AudioProcessorListener {
+class JuceAAPWrapper : juce::AudioPlayHead, juce::AudioProcessorListener, juce::Timer {
+    // The members are laid out by the thread that touches them: immutable-after-construction fields,
+    // the per-block (audio thread) state, then each field that other threads write to on its own
+    // cache line, so that neither the message thread nor other instances bounce the audio thread's lines.
     AndroidAudioPlugin *aap;
     const char *plugin_unique_id;
-    int sample_rate;
     AndroidAudioPluginHost host;
-    aap_buffer_t *buffer;
-    aap_state_t state{nullptr, 0};
     juce::AudioProcessor *juce_processor;
+
+    // Audio port routing plan. The routes are built from the port list at prepare(), and the
+    // channel pointers and the copy list are recompiled only when the aap_buffer_t port buffers change.
+    struct AudioPortRoute {
+        int32_t aap_port;
+        int32_t juce_channel;
+        float* port_buffer;
+    };
+    struct AudioChannelCopy {
+        const float* src;
+        float* dst;
+    };
+
+    typedef void (JuceAAPWrapper::*UmpDecoder)(const cmidi2_ump* ump);
+    typedef void (*ProcessKernel)(AndroidAudioPlugin *plugin, aap_buffer_t *audioBuffer, int32_t frameCount, int64_t timeoutInNanoseconds);
+
+    // Parameter tables. They are built by buildParameterList() at construction and never change
+    // afterwards, so the audio thread only reads them.
+    juce::OwnedArray<aap_parameter_info_t> aapParams{};
+    juce::HashMap<int32_t,int32_t> aapParamIdToEnumIndex{};
+    juce::OwnedArray<aap_parameter_enum_t> aapEnums{};
+
+    // Dense table indexed by AAP parameter ID (which is the JUCE parameter index), so that
+    // the audio thread can resolve a parameter with a bounds check and an array load.
+    struct ParameterBinding {
+        juce::AudioProcessorParameter* parameter{nullptr};
+        const juce::NormalisableRange<float>* range{nullptr}; // only for RangedAudioParameter
+        aap_parameter_info_t* info{nullptr};
+        double min_value{0.0};
+        double max_value{1.0};
+    };
+    std::vector<ParameterBinding> parameter_bindings{};
+
+#if JUCEAAP_SAMPLE_ACCURATE_PARAMETERS
+    struct TimedParameterChange {
+        int32_t sample;
+        int32_t id;
+        float normalized_value;
+    };
+#endif
+
+    // The scalars that processBlock() reads or writes on every block, touched only by the audio thread
+    // (and by prepare()). They are grouped so that they fit in one cache line.
+    struct alignas(JUCEAAP_CACHE_LINE_SIZE) BlockState {
+        aap_buffer_t *buffer{nullptr};
+        ProcessKernel process_kernel{processKernel<0>};
+        const UmpDecoder* ump_decoders{nullptr};
+        int32_t midi_decoder_jr_position{0}; // relative to the block start, so it never gets near 2^31.
+        int32_t sample_rate{0};
+        int32_t aap_midi2_in_port{-1};
+        int32_t aap_midi2_out_port{-1};
+        int32_t num_juce_channels{0};
+        int32_t midi_decoder_sample{0};
+        int32_t midi_decoder_frame_count{0};
+        int32_t consecutive_deadline_overruns{0};
+        bool deadline_overruns_notification_pending{false};
+    };
+    BlockState block;
+
+    // per-block buffers and routing, touched only by the audio thread (and by prepare()).
+    // Their headers are read every block; what they point to lives on the heap.
     juce::HeapBlock<float*> juce_channels;
     juce::AudioSampleBuffer juce_audio_buffer;
-
     juce::MidiBuffer juce_midi_messages;
-    int32_t aap_midi2_in_port{-1}, aap_midi2_out_port{-1};
-    std::map<int32_t,int32_t> aap_to_juce_portmap_in{};
-    std::map<int32_t,int32_t> aap_to_juce_portmap_out{};
-    std::map<int32_t,int32_t> portmap_juce_to_aap_out{};
-
-    struct PendingParameterChange {
-        uint16_t index{0};
-        float value{0};
-    };
-    std::mutex pending_parameter_changes_lock{};
-    std::vector<PendingParameterChange> pending_parameter_changes{};
-    std::vector<float> last_parameter_values{};
+    // note-offs etc. from a block that substituteBlock() replaced, for the next block.
+    juce::MidiBuffer deferred_midi_messages;
+    std::vector<AudioPortRoute> audio_in_routes{};
+    std::vector<AudioPortRoute> audio_out_routes{};
+    std::vector<AudioChannelCopy> audio_out_copies{};
+
+    // Incoming (host-originated) parameter changes are coalesced per block (last value wins)
+    // and applied once before processBlock(). Their listener notifications are delivered on
+    // the message thread by timerCallback(), and they are not echoed back to the host.
+    std::vector<float> incoming_parameter_values{};
+    std::vector<uint8_t> incoming_parameter_dirty{};
+    std::vector<int32_t> incoming_parameter_ids{};
+
+#if JUCEAAP_SAMPLE_ACCURATE_PARAMETERS
+    // They are sized at prepare(); the decoder applies changes immediately when it is full.
+    std::vector<TimedParameterChange> timed_parameter_changes{};
+    size_t num_timed_parameter_changes{0};
+    juce::HeapBlock<float*> juce_slice_channels;
+    juce::AudioBuffer<float> juce_slice_audio_buffer;
+    juce::MidiBuffer juce_midi_block_input;
+    juce::MidiBuffer juce_midi_slice;
+#endif
+#if JUCEAAP_PROCESS_DEADLINE_POLICY == JUCEAAP_PROCESS_DEADLINE_POLICY_LAST_GOOD_BLOCK
+    juce::AudioBuffer<float> last_good_block;
+#endif
 
 #if JUCEAAP_HAVE_AUDIO_PLAYHEAD_NEW_POSITION_INFO
     juce::AudioPlayHead::PositionInfo play_head_position;
 #else
     juce::AudioPlayHead::CurrentPositionInfo play_head_position;
 #endif
+
+    // Cold audio-thread data: the status values (touched only when they change), the timing defaults and
+    // the sysex accumulator (touched only while a sysex arrives, which may span blocks).
+    // It is kept after everything that is touched on every block.
+    alignas(JUCEAAP_CACHE_LINE_SIZE) uint32_t num_deadline_overruns{0};
+    int32_t last_reported_latency{-1};
+    int64_t last_reported_tail{-1};
+    int32_t current_bpm = 120; // FIXME: provide way to adjust it
+    int32_t default_time_division = 192;
+    uint32_t sysex_offset{0};
+    uint8_t sysex_buffer[4096];
+
+    // cross-thread queues; they align their own producer and consumer positions.
+    alignas(JUCEAAP_CACHE_LINE_SIZE) JuceAAPParameterChangeQueue pending_parameter_changes{};
+    alignas(JUCEAAP_CACHE_LINE_SIZE) JuceAAPParameterChangeQueue parameter_notifications{};
+
+    // message thread state. Nothing that the audio thread writes is declared after this.
+    alignas(JUCEAAP_CACHE_LINE_SIZE) std::atomic<bool> status_notification_pending{false};
+    aap_state_t state{nullptr, 0};
+    static constexpr int PARAMETER_NOTIFICATION_HZ = 30;
+    // the last value of each parameter (by parameter index) that the host knows about.
+    // It is allocated at construction so that listener callbacks on the audio thread only store into it.
+    std::unique_ptr<std::atomic<float>[]> tracked_parameter_values{};
+    size_t num_tracked_parameters{0};
     int android_preferred_view_width{0};
     int android_preferred_view_height{0};
 
@@ -155,12 +630,19 @@ public:
         juce_processor = createPluginFilter();
 
         buildParameterList();
+        pending_parameter_changes.allocate((uint32_t) jmax(juce_processor->getParameters().size(),
+                                                           juce_processor->getNumParameters()));
 
+        allocateTrackedParameterValues();
         juce_processor->addListener(this);
-        last_parameter_values = snapshotParameterValues();
+
+        // Timer callbacks run on the message thread, so it is started and stopped there too.
+        juceaap_callOnExistingMessageThreadIfNeeded([&] { startTimerHz(PARAMETER_NOTIFICATION_HZ); });
     }
 
     virtual ~JuceAAPWrapper() {
+        // stopping on the message thread guarantees that no timerCallback() is running while we are destroyed.
+        juceaap_callOnExistingMessageThreadIfNeeded([&] { stopTimer(); });
         juce_processor->releaseResources();
 
         if (state.data != nullptr)
@@ -184,10 +666,6 @@ public:
 
     const char* getPluginId() { return plugin_unique_id; }
 
-    juce::OwnedArray<aap_parameter_info_t> aapParams{};
-    juce::HashMap<int32_t,int32_t> aapParamIdToEnumIndex{};
-    juce::OwnedArray<aap_parameter_enum_t> aapEnums{};
-
     void registerParameter(juce::String path, juce::AudioProcessorParameter* para) {
         aap_parameter_info_t info{};
         strncpy(info.path, path.toRawUTF8(), sizeof(info.path));
@@ -257,26 +735,82 @@ public:
                 aapParams.add(new aap_parameter_info_t(p));
             }
         }
+
+        buildParameterBindings();
+    }
+
+    void buildParameterBindings() {
+        parameter_bindings.clear();
+
+        auto& parameters = juce_processor->getParameters();
+        int32_t maxId = -1;
+        for (auto* para : parameters)
+            maxId = jmax(maxId, para->getParameterIndex());
+        for (auto* info : aapParams)
+            maxId = jmax(maxId, (int32_t) info->stable_id);
+        parameter_bindings.resize((size_t) (maxId + 1));
+
+        for (auto* para : parameters) {
+            auto& binding = parameter_bindings[(size_t) para->getParameterIndex()];
+            binding.parameter = para;
+            if (auto* ranged = dynamic_cast<juce::RangedAudioParameter*>(para))
+                binding.range = &ranged->getNormalisableRange();
+        }
+        for (auto* info : aapParams) {
+            if (info->stable_id < 0)
+                continue;
+            auto& binding = parameter_bindings[(size_t) info->stable_id];
+            binding.info = info;
+            binding.min_value = info->min_value;
+            binding.max_value = info->max_value;
+        }
+
+        incoming_parameter_values.assign(parameter_bindings.size(), 0);
+        incoming_parameter_dirty.assign(parameter_bindings.size(), 0);
+        incoming_parameter_ids.clear();
+        incoming_parameter_ids.reserve(parameter_bindings.size());
+        parameter_notifications.allocate((uint32_t) parameter_bindings.size());
+    }
+
+    inline const ParameterBinding* findParameterBinding(int32_t id) const {
+        return id >= 0 && (size_t) id < parameter_bindings.size() ? &parameter_bindings[(size_t) id] : nullptr;
     }
 
     // juce::AudioProcessorListener implementation
     void audioProcessorParameterChanged(juce::AudioProcessor* processor, int parameterIndex, float newValue) override {
-        enqueueParameterChange(parameterIndex, newValue);
-        updateTrackedParameterValue(parameterIndex, newValue);
+        // The host already knows the values it sent (they are tracked in applyParameterChange()),
+        // so only the values that differ from what the host knows go back through the MIDI2 output.
+        if (parameterIndex < 0 || (size_t) parameterIndex >= num_tracked_parameters)
+            enqueueParameterChange(parameterIndex, newValue);
+        else if (tracked_parameter_values[(size_t) parameterIndex].exchange(newValue, std::memory_order_relaxed) != newValue)
+            enqueueParameterChange(parameterIndex, newValue);
+    }
+
+    // juce::Timer implementation
+    void timerCallback() override {
+        parameter_notifications.drain(UINT32_MAX, [&](uint32_t index, float) {
+            auto* binding = findParameterBinding((int32_t) index);
+            if (binding == nullptr || binding->parameter == nullptr)
+                return;
+            // notify the current value; if the plugin changed it after the host did, that change is not lost.
+            binding->parameter->sendValueChangedMessageToListeners(binding->parameter->getValue());
+        });
     }
 
 #if JUCEAAP_AUDIO_PROCESSOR_CHANGE_DETAILS_UNAVAILABLE
     void audioProcessorChanged(juce::AudioProcessor* processor) override {
-        enqueueChangedParameters(last_parameter_values);
-        last_parameter_values = snapshotParameterValues();
+        // we cannot tell whether the latency or the tail has changed; only a changed value is sent anyway.
+        status_notification_pending.store(true, std::memory_order_release);
+        enqueueChangedParameters();
         auto ext = (aap_parameters_host_extension_t *) host.get_extension(&host, AAP_PARAMETERS_EXTENSION_URI);
         if (ext)
             ext->notify_parameters_changed(ext, &host);
     }
 #else
     void audioProcessorChanged(juce::AudioProcessor* processor, const juce::AudioProcessorListener::ChangeDetails &details) override {
-        enqueueChangedParameters(last_parameter_values);
-        last_parameter_values = snapshotParameterValues();
+        // JUCE does not tell whether the tail has changed; only a changed value is sent anyway.
+        status_notification_pending.store(true, std::memory_order_release);
+        enqueueChangedParameters();
         if (details.parameterInfoChanged) {
             auto ext = (aap_parameters_host_extension_t *) host.get_extension(&host, AAP_PARAMETERS_EXTENSION_URI);
             if (ext)
@@ -370,7 +904,7 @@ public:
         juce_audio_buffer.setSize(juce_processor->getMainBusNumOutputChannels(), aapBuffer->num_frames(aapBuffer));
 
         // allocates juce_buffer. No need to interpret content.
-        this->buffer = aapBuffer;
+        block.buffer = aapBuffer;
         if (juce_processor->getBusCount(true) > 0) {
             juce_processor->getBus(true, 0)->enable();
         }
@@ -384,7 +918,8 @@ public:
     }
 
     void prepare(int32_t sampleRate, aap_buffer_t *buffer) {
-        sample_rate = sampleRate;
+        block.sample_rate = sampleRate;
+        juce_aap_wrapper_last_error_code = JUCEAAP_SUCCESS;
         allocateBuffer(buffer);
         if (juce_aap_wrapper_last_error_code != JUCEAAP_SUCCESS)
             return;
@@ -392,11 +927,9 @@ public:
         // retrieve AAP MDI2 ports. They are different from juce::AudioProcessor.acceptsMidi()
         auto pluginInfoExt = (aap_host_plugin_info_extension_t*) host.get_extension(&host, AAP_PLUGIN_INFO_EXTENSION_URI);
         if (pluginInfoExt) {
-            aap_to_juce_portmap_in.clear();
-            aap_to_juce_portmap_out.clear();
-            portmap_juce_to_aap_out.clear();
+            audio_in_routes.clear();
+            audio_out_routes.clear();
             int jucePortInIdx = 0, jucePortOutIdx = 0;
-            int nOut = juce_processor->getMainBusNumOutputChannels();
 
             auto pluginInfo = pluginInfoExt->get(pluginInfoExt, &host, plugin_unique_id);
             for (int i = 0, n = pluginInfo.get_port_count(&pluginInfo); i < n; i++) {
@@ -404,17 +937,15 @@ public:
                 switch (port.content_type(&port)) {
                     case AAP_CONTENT_TYPE_MIDI2:
                         if (port.direction(&port) == AAP_PORT_DIRECTION_INPUT)
-                            aap_midi2_in_port = i;
+                            block.aap_midi2_in_port = i;
                         else
-                            aap_midi2_out_port = i;
+                            block.aap_midi2_out_port = i;
                         break;
                     case AAP_CONTENT_TYPE_AUDIO:
                         if (port.direction(&port) == AAP_PORT_DIRECTION_INPUT)
-                            aap_to_juce_portmap_in[i] = jucePortInIdx++;
-                        else {
-                            portmap_juce_to_aap_out[jucePortOutIdx] = i;
-                            aap_to_juce_portmap_out[i] = jucePortOutIdx++;
-                        }
+                            audio_in_routes.push_back(AudioPortRoute{i, jucePortInIdx++, nullptr});
+                        else
+                            audio_out_routes.push_back(AudioPortRoute{i, jucePortOutIdx++, nullptr});
                         break;
                     default:
                         break;
@@ -422,6 +953,45 @@ public:
             }
         }
 
+        block.num_juce_channels = jmax(juce_processor->getMainBusNumInputChannels(), juce_processor->getMainBusNumOutputChannels());
+#if JUCEAAP_PROCESS_DEADLINE_POLICY == JUCEAAP_PROCESS_DEADLINE_POLICY_LAST_GOOD_BLOCK
+        last_good_block.setSize(block.num_juce_channels, buffer->num_frames(buffer));
+        last_good_block.clear();
+#endif
+        block.consecutive_deadline_overruns = 0;
+        sysex_offset = 0;
+        deferred_midi_messages.clear();
+        // the host learns the latency and the tail with the first processed block.
+        last_reported_latency = -1;
+        last_reported_tail = -1;
+        status_notification_pending.store(true, std::memory_order_release);
+        auto isUnroutable = [&](const AudioPortRoute& r) { return r.juce_channel >= block.num_juce_channels; };
+        audio_in_routes.erase(std::remove_if(audio_in_routes.begin(), audio_in_routes.end(), isUnroutable), audio_in_routes.end());
+        audio_out_routes.erase(std::remove_if(audio_out_routes.begin(), audio_out_routes.end(), isUnroutable), audio_out_routes.end());
+        audio_out_copies.reserve(audio_out_routes.size());
+        compileRoutingPlan(buffer);
+
+        block.ump_decoders = getUmpDecoders(juce_processor->acceptsMidi());
+        if (block.aap_midi2_in_port >= 0) {
+            // A UMP can expand to up to four MIDI 1.0 events (e.g. RPN to CCs), and each MidiBuffer
+            // event takes a 6-byte header, so reserve enough not to grow on the audio thread.
+            auto umpCapacity = buffer->get_buffer_size(buffer, block.aap_midi2_in_port) - (int32_t) sizeof(AAPMidiBufferHeader);
+            if (umpCapacity > 0) {
+                juce_midi_messages.ensureSize((size_t) umpCapacity * 5);
+                deferred_midi_messages.ensureSize((size_t) umpCapacity * 5);
+            }
+#if JUCEAAP_SAMPLE_ACCURATE_PARAMETERS
+            if (umpCapacity > 0) {
+                juce_midi_block_input.ensureSize((size_t) umpCapacity * 5);
+                juce_midi_slice.ensureSize((size_t) umpCapacity * 5);
+                // each parameter change takes one 128-bit UMP.
+                timed_parameter_changes.resize((size_t) umpCapacity / 16);
+            }
+            num_timed_parameter_changes = 0;
+            juce_slice_channels.calloc(block.num_juce_channels);
+#endif
+        }
+
 #if JUCEAAP_HAVE_AUDIO_PLAYHEAD_NEW_POSITION_INFO
         play_head_position.setBpm(120);
         play_head_position.setTimeInSamples(0);
@@ -437,10 +1007,10 @@ public:
         juce_processor->setPlayConfigDetails(
                 getNumberOfChannelsOfBus(juce_processor->getBus(true, 0)),
                 getNumberOfChannelsOfBus(juce_processor->getBus(false, 0)),
-                sample_rate, buffer->num_frames(buffer));
+                block.sample_rate, buffer->num_frames(buffer));
         juce_processor->setPlayHead(this);
 
-        juce_processor->prepareToPlay(sample_rate, buffer->num_frames(buffer));
+        juce_processor->prepareToPlay(block.sample_rate, buffer->num_frames(buffer));
     }
 
     void activate() {
@@ -459,450 +1029,551 @@ public:
 #endif
     }
 
-    int32_t current_bpm = 120; // FIXME: provide way to adjust it
-    int32_t default_time_division = 192;
-
-    uint8_t sysex_buffer[4096];
-    int32_t sysex_offset{0};
-
     void enqueueParameterChange(int parameterIndex, float newValue) {
         if (parameterIndex < 0 || parameterIndex > UINT16_MAX)
             return;
 
-        std::lock_guard<std::mutex> lock(pending_parameter_changes_lock);
-        pending_parameter_changes.push_back(PendingParameterChange{static_cast<uint16_t>(parameterIndex), newValue});
+        pending_parameter_changes.push((uint32_t) parameterIndex, newValue);
     }
 
-    void enqueueChangedParameters(const std::vector<float>& oldValues) {
-        auto parameters = juce_processor->getParameterTree().getParameters(true);
-        if (!parameters.isEmpty()) {
-            for (int i = 0; i < parameters.size() && i < oldValues.size(); i++) {
-                auto* param = parameters[i];
-                if (param == nullptr)
-                    continue;
-                auto newValue = param->getValue();
-                if (newValue != oldValues[i])
-                    enqueueParameterChange(param->getParameterIndex(), newValue);
-            }
-            return;
-        }
-
-        for (int i = 0, n = juce_processor->getNumParameters(); i < n && i < oldValues.size(); i++) {
-            auto newValue = juce_processor->getParameter(i);
-            if (newValue != oldValues[i])
-                enqueueParameterChange(i, newValue);
-        }
+    float getCurrentParameterValue(size_t parameterIndex) {
+        auto* binding = findParameterBinding((int32_t) parameterIndex);
+        if (binding != nullptr && binding->parameter != nullptr)
+            return binding->parameter->getValue();
+        if ((int) parameterIndex < juce_processor->getNumParameters())
+            return juce_processor->getParameter((int) parameterIndex);
+        return 0;
     }
 
-    void updateTrackedParameterValue(int parameterIndex, float newValue) {
-        auto parameters = juce_processor->getParameterTree().getParameters(true);
-        if (!parameters.isEmpty()) {
-            for (int i = 0; i < parameters.size(); i++) {
-                auto* param = parameters[i];
-                if (param == nullptr || param->getParameterIndex() != parameterIndex)
-                    continue;
-                if (i >= last_parameter_values.size())
-                    last_parameter_values = snapshotParameterValues();
-                else
-                    last_parameter_values[(size_t) i] = newValue;
-                return;
-            }
-        }
-
-        if (parameterIndex < 0)
-            return;
-        if ((size_t) parameterIndex >= last_parameter_values.size())
-            last_parameter_values = snapshotParameterValues();
-        else
-            last_parameter_values[(size_t) parameterIndex] = newValue;
+    void allocateTrackedParameterValues() {
+        num_tracked_parameters = (size_t) jmax((int) parameter_bindings.size(), juce_processor->getNumParameters());
+        tracked_parameter_values.reset(new std::atomic<float>[num_tracked_parameters]);
+        for (size_t i = 0; i < num_tracked_parameters; i++)
+            tracked_parameter_values[i].store(getCurrentParameterValue(i), std::memory_order_relaxed);
     }
 
-    std::vector<float> snapshotParameterValues() {
-        std::vector<float> values;
-        auto parameters = juce_processor->getParameterTree().getParameters(true);
-        if (!parameters.isEmpty()) {
-            values.reserve(parameters.size());
-            for (auto* param : parameters)
-                values.push_back(param != nullptr ? param->getValue() : 0);
-            return values;
+    // reports every parameter whose value differs from what the host last knew.
+    void enqueueChangedParameters() {
+        for (size_t i = 0; i < num_tracked_parameters; i++) {
+            auto newValue = getCurrentParameterValue(i);
+            if (tracked_parameter_values[i].exchange(newValue, std::memory_order_relaxed) != newValue)
+                enqueueParameterChange((int) i, newValue);
         }
+    }
 
-        auto count = juce_processor->getNumParameters();
-        values.reserve(count);
-        for (int i = 0; i < count; i++)
-            values.push_back(juce_processor->getParameter(i));
-        return values;
+    void updateTrackedParameterValue(int parameterIndex, float newValue) {
+        if (parameterIndex >= 0 && (size_t) parameterIndex < num_tracked_parameters)
+            tracked_parameter_values[(size_t) parameterIndex].store(newValue, std::memory_order_relaxed);
     }
 
     aap_parameter_info_t* findAAPParameterInfoById(int id) {
-        for (auto* info : aapParams)
-            if (info != nullptr && info->stable_id == id)
-                return info;
-        return nullptr;
+        auto* binding = findParameterBinding(id);
+        return binding != nullptr ? binding->info : nullptr;
     }
 
     uint32_t juceNormalizedToTransportUint32(int parameterIndex, float normalizedValue) {
-        auto* info = findAAPParameterInfoById(parameterIndex);
-        auto* param = findJUCEParameter(parameterIndex);
-        auto plainValue = (double) normalizedValue;
-        if (auto* ranged = dynamic_cast<juce::RangedAudioParameter*>(param))
-            plainValue = ranged->getNormalisableRange().convertFrom0to1(normalizedValue);
-        if (info == nullptr)
+        auto* binding = findParameterBinding(parameterIndex);
+        if (binding == nullptr || binding->info == nullptr)
             return aapParameterNormalizedToUint32(normalizedValue);
-        return aapParameterPlainToTransportUint32(info->min_value, info->max_value, plainValue);
+        auto plainValue = binding->range != nullptr ? (double) binding->range->convertFrom0to1(normalizedValue) : (double) normalizedValue;
+        return aapParameterPlainToTransportUint32(binding->min_value, binding->max_value, plainValue);
     }
 
-    float transportUint32ToJuceNormalized(int parameterIndex, uint32_t transportValue) {
-        auto* info = findAAPParameterInfoById(parameterIndex);
-        auto* param = findJUCEParameter(parameterIndex);
+    float transportUint32ToJuceNormalized(const ParameterBinding* binding, uint32_t transportValue) {
         auto normalizedValue = aapParameterUint32ToNormalized(transportValue);
-        if (info == nullptr)
+        if (binding == nullptr || binding->info == nullptr)
             return (float) normalizedValue;
-        auto plainValue = aapParameterNormalizedToPlain(info->min_value, info->max_value, normalizedValue);
-        if (auto* ranged = dynamic_cast<juce::RangedAudioParameter*>(param))
-            return ranged->getNormalisableRange().convertTo0to1((float) plainValue);
+        auto plainValue = aapParameterNormalizedToPlain(binding->min_value, binding->max_value, normalizedValue);
+        if (binding->range != nullptr)
+            return binding->range->convertTo0to1((float) plainValue);
         return (float) plainValue;
     }
 
-    void flushParameterChanges(aap_buffer_t* buffer) {
-        if (aap_midi2_out_port < 0)
-            return;
-
-        if ((uint32_t) aap_midi2_out_port >= buffer->num_ports(buffer))
-            return;
+    uint32_t getTailSamples() {
+        auto seconds = juce_processor->getTailLengthSeconds();
+        if (!std::isfinite(seconds))
+            return UINT32_MAX;
+        auto samples = std::ceil(jmax(0.0, seconds) * block.sample_rate);
+        return samples >= (double) UINT32_MAX ? UINT32_MAX : (uint32_t) samples;
+    }
 
-        std::vector<PendingParameterChange> changes;
-        if (!pending_parameter_changes_lock.try_lock())
+    // The status and the parameter changes go after the plugin's own MIDI output, whose JR timestamps end at
+    // midiOutTicks. They are placed at the last sample of the block by an explicit JR timestamp, instead of
+    // taking over the position of whichever event the plugin output last.
+    void flushParameterChanges(aap_buffer_t* buffer, int32_t frameCount, int64_t midiOutTicks) {
+        if (block.aap_midi2_out_port < 0)
             return;
-        changes.swap(pending_parameter_changes);
-        pending_parameter_changes_lock.unlock();
 
-        if (changes.empty())
+        if ((uint32_t) block.aap_midi2_out_port >= buffer->num_ports(buffer))
             return;
 
-        auto* outMidiBuf = (AAPMidiBufferHeader*) buffer->get_buffer(buffer, aap_midi2_out_port);
-        auto* umpDst = (uint32_t*) (void*) ((uint8_t*) outMidiBuf + sizeof(AAPMidiBufferHeader) + outMidiBuf->length);
-
-        for (auto& change : changes) {
-            auto transportValue = juceNormalizedToTransportUint32(change.index, change.value);
-            aapMidi2ParameterSysex8(umpDst, umpDst + 1, umpDst + 2, umpDst + 3,
-                                    0, 0, 0, 0, change.index, transportValue);
+        auto* outMidiBuf = (AAPMidiBufferHeader*) buffer->get_buffer(buffer, block.aap_midi2_out_port);
+        auto capacity = (int64_t) buffer->get_buffer_size(buffer, block.aap_midi2_out_port) - (int64_t) sizeof(AAPMidiBufferHeader);
+        auto endTicks = (int64_t) jmax(0, frameCount - 1) * CMIDI2_JR_TIMESTAMP_TICKS_PER_SECOND / block.sample_rate;
+        auto deltaTicks = jmax((int64_t) 0, endTicks - midiOutTicks);
+        // A JR timestamp can hold up to 0xFFFF ticks, and there is always at least one.
+        auto numTimestamps = jmax((int64_t) 1, (deltaTicks + 0xFFFE) / 0xFFFF);
+        auto available = capacity - (int64_t) outMidiBuf->length - numTimestamps * 4;
+        if (available < 16)
+            return; // whatever does not fit is kept for the next block.
+        auto* timestampDst = (uint32_t*) (void*) ((uint8_t*) outMidiBuf + sizeof(AAPMidiBufferHeader) + outMidiBuf->length);
+        auto* packetsBegin = timestampDst + numTimestamps;
+        auto* umpDst = packetsBegin;
+
+        if (status_notification_pending.load(std::memory_order_relaxed) &&
+            status_notification_pending.exchange(false, std::memory_order_acquire)) {
+            auto latency = jmax(0, juce_processor->getLatencySamples());
+            if (latency != last_reported_latency) {
+                last_reported_latency = latency;
+                juceaap_statusSysex8(umpDst, JUCEAAP_STATUS_LATENCY, (uint32_t) latency);
+                umpDst += 4;
+                available -= 16;
+            }
+            auto tail = getTailSamples();
+            if (tail != last_reported_tail) {
+                if (available >= 16) {
+                    last_reported_tail = tail;
+                    juceaap_statusSysex8(umpDst, JUCEAAP_STATUS_TAIL, tail);
+                    umpDst += 4;
+                    available -= 16;
+                } else
+                    status_notification_pending.store(true, std::memory_order_relaxed); // next block
+            }
+        }
+        if (available >= 16 && block.deadline_overruns_notification_pending) {
+            block.deadline_overruns_notification_pending = false;
+            juceaap_statusSysex8(umpDst, JUCEAAP_STATUS_DEADLINE_OVERRUNS, num_deadline_overruns);
             umpDst += 4;
-            outMidiBuf->length += 16;
+            available -= 16;
         }
+        if (available >= 16)
+            pending_parameter_changes.drain((uint32_t) (available / 16), [&](uint32_t index, float value) {
+                auto transportValue = juceNormalizedToTransportUint32((int) index, value);
+                aapMidi2ParameterSysex8(umpDst, umpDst + 1, umpDst + 2, umpDst + 3,
+                                        0, 0, 0, 0, (uint16_t) index, transportValue);
+                umpDst += 4;
+            });
+
+        if (umpDst == packetsBegin)
+            return; // nothing to send, so no timestamp either.
+        for (int64_t i = 0; i < numTimestamps; i++, deltaTicks -= 0xFFFF)
+            timestampDst[i] = (uint32_t) cmidi2_ump_jr_timestamp_direct((uint16_t) jmin(deltaTicks, (int64_t) 0xFFFF));
+        outMidiBuf->length += (uint32_t) ((uint8_t*) umpDst - (uint8_t*) timestampDst);
     }
 
     bool readMidi2Parameter(uint8_t *group, uint8_t* channel, uint8_t* key, uint8_t* extra,
-                            uint16_t *index, uint32_t *value, cmidi2_ump* ump) {
-        auto raw = (uint32_t*) ump;
+                            uint16_t *index, uint32_t *value, const cmidi2_ump* ump) {
+        auto raw = (const uint32_t*) ump;
         return aapReadMidi2ParameterSysex8(group, channel, key, extra, index, value,
                                            *raw, *(raw + 1), *(raw + 2), *(raw + 3));
     }
 
-    void processMidiInputs(aap_buffer_t *audioBuffer, int32_t frameCount) {
+    // UMP decoders, dispatched by message type (and by status for MIDI 2.0 channel voice messages).
+    // They write MIDI 1.0 bytes straight into juce_midi_messages, which is preallocated at prepare().
+    static const UmpDecoder* getUmpDecoders(bool acceptsMidi) {
+        static const UmpDecoder parameterDecoders[16] = {
+                &JuceAAPWrapper::decodeUmpUtility, nullptr, nullptr, nullptr,
+                nullptr, &JuceAAPWrapper::decodeUmpSysex8, nullptr, nullptr,
+                nullptr, nullptr, nullptr, nullptr,
+                nullptr, nullptr, nullptr, nullptr
+        };
+        static const UmpDecoder midiDecoders[16] = {
+                &JuceAAPWrapper::decodeUmpUtility, &JuceAAPWrapper::decodeUmpSystem,
+                &JuceAAPWrapper::decodeUmpMidi1, &JuceAAPWrapper::decodeUmpSysex7,
+                &JuceAAPWrapper::decodeUmpMidi2, &JuceAAPWrapper::decodeUmpSysex8, nullptr, nullptr,
+                nullptr, nullptr, nullptr, nullptr,
+                nullptr, nullptr, nullptr, nullptr
+        };
+        return acceptsMidi ? midiDecoders : parameterDecoders;
+    }
 
-        sysex_offset = 0;
-        auto midiInBuf = (AAPMidiBufferHeader*) audioBuffer->get_buffer(audioBuffer, aap_midi2_in_port);
-        auto umpStart = ((uint8_t*) midiInBuf) + sizeof(AAPMidiBufferHeader);
-        int32_t positionInJRTimestamp = 0;
+    inline void addMidi1Event(uint8_t status, uint8_t data1, uint8_t data2) {
+        const uint8_t bytes[3]{status, data1, data2};
+        // JUCE trims the event to the actual length that the status byte implies.
+        juce_midi_messages.addEvent(bytes, 3, block.midi_decoder_sample);
+    }
 
-        // Process parameter changes first. The rest is handled only if the JUCE plugin accepts MIDI.
-        CMIDI2_UMP_SEQUENCE_FOREACH(umpStart, midiInBuf->length, iter) {
-            auto ump = (cmidi2_ump*) (void*) iter;
-
-            uint8_t paramGroup, paramChannel, paramKey{0}, paramExtra{0};
-            uint16_t paramId;
-            uint32_t paramValue;
-            if (readMidi2Parameter(&paramGroup, &paramChannel, &paramKey, &paramExtra, &paramId, &paramValue, ump)) {
-                auto normalizedValue = transportUint32ToJuceNormalized(paramId, paramValue);
-                auto param = findJUCEParameter(paramId);
-                if (param != nullptr) {
-                    param->setValue(normalizedValue);
-                    param->sendValueChangedMessageToListeners (normalizedValue);
+    void decodeUmpUtility(const cmidi2_ump* ump) {
+        // Should we also cover JR Clock? how?
+        if (cmidi2_ump_get_status_code(ump) != CMIDI2_UTILITY_STATUS_JR_TIMESTAMP)
+            return;
+        block.midi_decoder_jr_position += cmidi2_ump_get_jr_timestamp_timestamp(ump);
+        auto sampleNumber = (int32_t) ((int64_t) block.midi_decoder_jr_position * block.sample_rate / CMIDI2_JR_TIMESTAMP_TICKS_PER_SECOND);
+        if (block.midi_decoder_frame_count > 0 && sampleNumber >= block.midi_decoder_frame_count)
+            sampleNumber = block.midi_decoder_frame_count - 1;
+        block.midi_decoder_sample = sampleNumber;
+    }
+
+    void decodeUmpSystem(const cmidi2_ump* ump) {
+        addMidi1Event(cmidi2_ump_get_status_byte(ump),
+                      cmidi2_ump_get_system_message_byte2(ump),
+                      cmidi2_ump_get_system_message_byte3(ump));
+    }
+
+    void decodeUmpMidi1(const cmidi2_ump* ump) {
+        addMidi1Event(cmidi2_ump_get_status_byte(ump),
+                      cmidi2_ump_get_midi1_byte2(ump),
+                      cmidi2_ump_get_midi1_byte3(ump));
+    }
+
+    void decodeUmpMidi2(const cmidi2_ump* ump) {
+        JuceAAPMidi2ChannelDecoder::decode(ump, juce_midi_messages, block.midi_decoder_sample);
+    }
+
+    void decodeUmpSysex7(const cmidi2_ump* ump) {
+        auto statusCode = cmidi2_ump_get_status_code(ump);
+        switch (statusCode) {
+            case CMIDI2_SYSEX_IN_ONE_UMP:
+            case CMIDI2_SYSEX_START:
+                sysex_buffer[0] = 0xF0;
+                sysex_offset = 1;
+                break;
+        }
+
+        auto sysex7U64 = cmidi2_ump_read_uint64_bytes(ump);
+        auto sysex7NumBytesInUmp = cmidi2_ump_get_sysex7_num_bytes(ump);
+        for (size_t i = 0; i < sysex7NumBytesInUmp; i++)
+            if (sysex_offset < sizeof(sysex_buffer))
+                sysex_buffer[sysex_offset++] = cmidi2_ump_get_byte_from_uint64(sysex7U64, 2 + i);
+
+        switch (statusCode) {
+            case CMIDI2_SYSEX_IN_ONE_UMP:
+            case CMIDI2_SYSEX_END:
+                if (sysex_offset < sizeof(sysex_buffer)) {
+                    sysex_buffer[sysex_offset++] = 0xF7;
+                    juce_midi_messages.addEvent(sysex_buffer, (int) sysex_offset, block.midi_decoder_sample);
                 }
-                else
-                    // The processor is as traditional as not providing parameter tree. We have to resort to traditional API.
-                    juce_processor->setParameter(paramId, normalizedValue);
-                continue;
-            }
+                sysex_offset = 0;
+                break;
         }
+    }
 
-        if (!juce_processor->acceptsMidi())
+    void decodeUmpSysex8(const cmidi2_ump* ump) {
+        uint8_t paramGroup, paramChannel, paramKey{0}, paramExtra{0};
+        uint16_t paramId;
+        uint32_t paramValue;
+        if (!readMidi2Parameter(&paramGroup, &paramChannel, &paramKey, &paramExtra, &paramId, &paramValue, ump))
             return;
 
+        auto binding = findParameterBinding(paramId);
+        auto normalizedValue = transportUint32ToJuceNormalized(binding, paramValue);
+#if JUCEAAP_SAMPLE_ACCURATE_PARAMETERS
+        if (block.midi_decoder_sample >= JUCEAAP_PARAMETER_SLICE_MIN_FRAMES &&
+            num_timed_parameter_changes < timed_parameter_changes.size()) {
+            timed_parameter_changes[num_timed_parameter_changes++] =
+                    TimedParameterChange{block.midi_decoder_sample, paramId, normalizedValue};
+            return;
+        }
+#endif
+        if (binding == nullptr) {
+            applyParameterChange(binding, paramId, normalizedValue);
+            return;
+        }
+        incoming_parameter_values[paramId] = normalizedValue;
+        if (!incoming_parameter_dirty[paramId]) {
+            incoming_parameter_dirty[paramId] = 1;
+            incoming_parameter_ids.push_back(paramId);
+        }
+    }
+
+    void applyIncomingParameterChanges() {
+        for (auto id : incoming_parameter_ids) {
+            incoming_parameter_dirty[id] = 0;
+            applyParameterChange(findParameterBinding(id), id, incoming_parameter_values[id]);
+        }
+        incoming_parameter_ids.clear();
+    }
+
+    void applyParameterChange(const ParameterBinding* binding, int32_t paramId, float normalizedValue) {
+        updateTrackedParameterValue(paramId, normalizedValue);
+        auto param = binding != nullptr ? binding->parameter : nullptr;
+        if (param != nullptr) {
+            param->setValue(normalizedValue);
+            // listeners are notified on the message thread (see timerCallback()).
+            parameter_notifications.push((uint32_t) paramId, normalizedValue);
+        }
+        else
+            // The processor is as traditional as not providing parameter tree. We have to resort to traditional API.
+            juce_processor->setParameter(paramId, normalizedValue);
+    }
+
+#if JUCEAAP_SAMPLE_ACCURATE_PARAMETERS
+    // Runs processBlock() over slices of juce_channels that begin at each timed parameter change.
+    // The slices point into the same channel buffers, so no audio is copied.
+    void processBlockInSlices(int32_t frameCount) {
+        juce_midi_block_input.swapWith(juce_midi_messages);
+        juce_midi_messages.clear();
+
+        size_t next = 0;
+        int32_t sliceStart = 0;
+        while (sliceStart < frameCount) {
+            while (next < num_timed_parameter_changes &&
+                   timed_parameter_changes[next].sample < sliceStart + JUCEAAP_PARAMETER_SLICE_MIN_FRAMES) {
+                auto& change = timed_parameter_changes[next++];
+                applyParameterChange(findParameterBinding(change.id), change.id, change.normalized_value);
+            }
+            int32_t sliceEnd = next < num_timed_parameter_changes ? timed_parameter_changes[next].sample : frameCount;
+            if (sliceEnd > frameCount - JUCEAAP_PARAMETER_SLICE_MIN_FRAMES)
+                sliceEnd = frameCount;
+            auto sliceLength = sliceEnd - sliceStart;
+
+            for (int ch = 0; ch < block.num_juce_channels; ch++)
+                juce_slice_channels[ch] = juce_channels[ch] + sliceStart;
+            juce_slice_audio_buffer.setDataToReferTo(juce_slice_channels.get(), block.num_juce_channels, sliceLength);
+            juce_midi_slice.clear();
+            juce_midi_slice.addEvents(juce_midi_block_input, sliceStart, sliceLength, -sliceStart);
+
+            juce_processor->processBlock(juce_slice_audio_buffer, juce_midi_slice);
+
+            juce_midi_messages.addEvents(juce_midi_slice, 0, -1, sliceStart);
+            advancePlayHead(sliceLength);
+            sliceStart = sliceEnd;
+        }
+
+        // whatever was too close to the end of the block takes effect from the next block.
+        for (; next < num_timed_parameter_changes; next++) {
+            auto& change = timed_parameter_changes[next];
+            applyParameterChange(findParameterBinding(change.id), change.id, change.normalized_value);
+        }
+        num_timed_parameter_changes = 0;
+    }
+#endif
+
+    void processMidiInputs(aap_buffer_t *audioBuffer, int32_t frameCount) {
+        block.midi_decoder_jr_position = 0;
+        block.midi_decoder_sample = 0;
+        block.midi_decoder_frame_count = frameCount;
         juce_midi_messages.clear();
 
+        auto midiInBuf = (AAPMidiBufferHeader*) audioBuffer->get_buffer(audioBuffer, block.aap_midi2_in_port);
+        auto umpStart = ((uint8_t*) midiInBuf) + sizeof(AAPMidiBufferHeader);
+
         // FIXME: for complete support for AudioPlayHead::CurrentPositionInfo, we would also
         //   have to store bpm and timeSignature, based on MIDI messages.
 
-        // We could use cmidi2_convert_ump_to_midi1, but afterward we have to iterate midi1 bytes again...
+        // Parameter changes and MIDI messages are decoded in one pass. If the JUCE plugin does not
+        // accept MIDI, the decoder table only contains the timestamp and parameter decoders.
         CMIDI2_UMP_SEQUENCE_FOREACH(umpStart, midiInBuf->length, iter) {
-            auto ump = (cmidi2_ump*) iter;
-            auto messageType = cmidi2_ump_get_message_type(ump);
-            auto statusCode = cmidi2_ump_get_status_code(ump);
-            if (messageType == CMIDI2_MESSAGE_TYPE_UTILITY) {
-                // Should we also cover JR Clock? how?
-                if (statusCode == CMIDI2_UTILITY_STATUS_JR_TIMESTAMP)
-                    positionInJRTimestamp += cmidi2_ump_get_jr_timestamp_timestamp(ump);
-                continue;
-            }
-
-            auto channel = cmidi2_ump_get_channel(ump);
-            auto statusByte = statusCode | channel;
-            int32_t sampleNumber = static_cast<int32_t>(
-                    (positionInJRTimestamp * 1.0 / 31250.0) * sample_rate);
-            if (sampleNumber < 0)
-                sampleNumber = 0;
-            if (frameCount > 0 && sampleNumber >= frameCount)
-                sampleNumber = frameCount - 1;
-
-            switch (messageType) {
-                case CMIDI2_MESSAGE_TYPE_MIDI_1_CHANNEL:
-                    juce_midi_messages.addEvent(
-                            MidiMessage(statusByte,
-                                        cmidi2_ump_get_midi1_byte2(ump),
-                                        cmidi2_ump_get_midi1_byte3(ump)),
-                            sampleNumber);
-                    break;
-                case CMIDI2_MESSAGE_TYPE_MIDI_2_CHANNEL: {
-                    switch (statusCode) {
-                        case CMIDI2_STATUS_RPN: {
-                            auto data = cmidi2_ump_get_midi2_rpn_data(ump);
-                            juce_midi_messages.addEvent(
-                                    MidiMessage(CMIDI2_STATUS_CC + channel,
-                                                CMIDI2_CC_RPN_MSB,
-                                                cmidi2_ump_get_midi2_rpn_msb(ump)),
-                                    sampleNumber);
-                            juce_midi_messages.addEvent(
-                                    MidiMessage(CMIDI2_STATUS_CC + channel,
-                                                CMIDI2_CC_RPN_LSB,
-                                                cmidi2_ump_get_midi2_rpn_lsb(ump)),
-                                    sampleNumber);
-                            juce_midi_messages.addEvent(
-                                    MidiMessage(CMIDI2_STATUS_CC + channel,
-                                                CMIDI2_CC_DTE_MSB,
-                                                (uint8_t) (data >> 25) & 0x7F),
-                                    sampleNumber);
-                            juce_midi_messages.addEvent(
-                                    MidiMessage(CMIDI2_STATUS_CC + channel,
-                                                CMIDI2_CC_DTE_LSB,
-                                                (uint8_t) (data >> 18) & 0x7F),
-                                    sampleNumber);
-                        } break;
-                        case CMIDI2_STATUS_NRPN: {
-                            auto data = cmidi2_ump_get_midi2_nrpn_data(ump);
-                            juce_midi_messages.addEvent(
-                                    MidiMessage(CMIDI2_STATUS_CC + channel,
-                                                CMIDI2_CC_NRPN_MSB,
-                                                cmidi2_ump_get_midi2_nrpn_msb(ump)),
-                                    sampleNumber);
-                            juce_midi_messages.addEvent(
-                                    MidiMessage(CMIDI2_STATUS_CC + channel,
-                                                CMIDI2_CC_NRPN_LSB,
-                                                cmidi2_ump_get_midi2_nrpn_lsb(ump)),
-                                    sampleNumber);
-                            juce_midi_messages.addEvent(
-                                    MidiMessage(CMIDI2_STATUS_CC + channel,
-                                                CMIDI2_CC_DTE_MSB,
-                                                (uint8_t) (data >> 25) & 0x7F),
-                                    sampleNumber);
-                            juce_midi_messages.addEvent(
-                                    MidiMessage(CMIDI2_STATUS_CC + channel,
-                                                CMIDI2_CC_DTE_LSB,
-                                                (uint8_t) (data >> 18) & 0x7F),
-                                    sampleNumber);
-                        } break;
-                        case CMIDI2_STATUS_NOTE_OFF:
-                        case CMIDI2_STATUS_NOTE_ON: {
-                            auto velocity16 = cmidi2_ump_get_midi2_note_velocity(ump);
-                            auto velocity7 = static_cast<uint8_t>(velocity16 / 0x200);
-                            juce_midi_messages.addEvent(
-                                    MidiMessage(statusByte,
-                                                cmidi2_ump_get_midi2_note_note(ump),
-                                                statusCode == CMIDI2_STATUS_NOTE_ON && velocity16 > 0 && velocity7 == 0
-                                                        ? static_cast<uint8_t>(1)
-                                                        : velocity7),
-                                    sampleNumber);
-                            break;
-                        }
-                        case CMIDI2_STATUS_PAF:
-                            juce_midi_messages.addEvent(
-                                    MidiMessage(statusByte,
-                                                cmidi2_ump_get_midi2_note_note(ump),
-                                                (uint8_t) (cmidi2_ump_get_midi2_paf_data(ump) /
-                                                           0x2000000)),
-                                    sampleNumber);
-                            break;
-                        case CMIDI2_STATUS_CC:
-                            juce_midi_messages.addEvent(
-                                    MidiMessage(statusByte,
-                                                cmidi2_ump_get_midi2_cc_index(ump),
-                                                (uint8_t) (cmidi2_ump_get_midi2_cc_data(ump) /
-                                                           0x2000000)),
-                                    sampleNumber);
-                            break;
-                        case CMIDI2_STATUS_PROGRAM:
-                            if (cmidi2_ump_get_midi2_program_options(ump) &
-                                CMIDI2_PROGRAM_CHANGE_OPTION_BANK_VALID) {
-                                juce_midi_messages.addEvent(
-                                        MidiMessage(CMIDI2_STATUS_CC + channel,
-                                                    CMIDI2_CC_BANK_SELECT,
-                                                    cmidi2_ump_get_midi2_program_bank_msb(ump)),
-                                        sampleNumber);
-                                juce_midi_messages.addEvent(
-                                        MidiMessage(CMIDI2_STATUS_CC + channel,
-                                                    CMIDI2_CC_BANK_SELECT_LSB,
-                                                    cmidi2_ump_get_midi2_program_bank_lsb(ump)),
-                                        sampleNumber);
-                            }
-                            juce_midi_messages.addEvent(
-                                    MidiMessage(statusByte,
-                                                cmidi2_ump_get_midi2_program_program(ump)),
-                                    sampleNumber);
-                            break;
-                        case CMIDI2_STATUS_CAF:
-                            juce_midi_messages.addEvent(
-                                    MidiMessage(statusByte,
-                                                (uint8_t) (cmidi2_ump_get_midi2_caf_data(ump) /
-                                                           0x2000000)),
-                                    sampleNumber);
-                            break;
-                        case CMIDI2_STATUS_PITCH_BEND: {
-                            auto data = cmidi2_ump_get_midi2_pitch_bend_data(ump);
-                            juce_midi_messages.addEvent(
-                                    MidiMessage(statusByte,
-                                                (uint8_t) (data >> 18) & 0x7F,
-                                                (uint8_t) (data >> 25) & 0x7F),
-                                    sampleNumber);
-                        } break;
-                    }
-                } break;
-                case CMIDI2_MESSAGE_TYPE_SYSEX7: {
-                    switch (statusCode) {
-                        case CMIDI2_SYSEX_IN_ONE_UMP:
-                        case CMIDI2_SYSEX_START:
-                            sysex_buffer[0] = 0xF0;
-                            sysex_offset = 1;
-                            break;
-                    }
-
-                    auto sysex7U64 = cmidi2_ump_read_uint64_bytes(ump);
-                    auto sysex7NumBytesInUmp = cmidi2_ump_get_sysex7_num_bytes(ump);
-                    for (size_t i = 0; i < sysex7NumBytesInUmp; i++)
-                        if (sysex_offset < sizeof(sysex_buffer))
-                            sysex_buffer[sysex_offset++] = cmidi2_ump_get_byte_from_uint64(sysex7U64, 2 + i);
-
-                    switch (statusCode) {
-                        case CMIDI2_SYSEX_IN_ONE_UMP:
-                        case CMIDI2_SYSEX_END:
-                            if (sysex_offset < sizeof(sysex_buffer)) {
-                                sysex_buffer[sysex_offset++] = 0xF7;
-                                juce_midi_messages.addEvent(
-                                        MidiMessage(sysex_buffer, sysex_offset),
-                                        sampleNumber);
-                            }
-                            sysex_offset = 0;
-                            break;
-                    }
-                    break;
-                }
-            }
+            auto ump = (const cmidi2_ump*) (void*) iter;
+            auto decoder = block.ump_decoders[cmidi2_ump_get_message_type(ump)];
+            if (decoder != nullptr)
+                (this->*decoder)(ump);
         }
+
+        applyIncomingParameterChanges();
     }
 
-    void processMidiOutputs(aap_buffer_t* buffer) {
+    // Returns the JR position (in ticks from the block start) after the last event it wrote.
+    int64_t processMidiOutputs(aap_buffer_t* buffer) {
         // This part is not really verified... we need some JUCE plugin that generates some outputs.
-        if (aap_midi2_out_port < 0)
-            return;
-
-        void *dst = buffer->get_buffer(buffer, aap_midi2_out_port);
-        auto outMidiBuf = (AAPMidiBufferHeader*) dst;
-        auto umpDst = (cmidi2_ump*) ((uint8_t*) dst + sizeof(AAPMidiBufferHeader));
-
-        MidiBuffer::Iterator iterator{juce_midi_messages};
-        const uint8_t *data;
-        int32_t eventSize, eventPos, dstBufSize = 0;
-        while (iterator.getNextEvent(data, eventSize, eventPos)) {
-            if (data[eventPos] == 0xF0) {
-                // sysex
-                memcpy(sysex_buffer, data + eventPos, eventSize);
-                auto numPackets = cmidi2_ump_sysex7_get_num_packets(eventSize);
-                for (int i = 0; i < numPackets; i++) {
-                    cmidi2_ump_write64(umpDst, cmidi2_ump_sysex7_get_packet_of(
-                            0, i + 1 < numPackets ? 6 : eventSize % 6,
-                            (void *) (data + eventPos + i * 6), i));
-                    umpDst += 2;
-                    dstBufSize += 8;
-                }
-            } else if (data[eventPos] > 0xF0) {
-                cmidi2_ump_write32(umpDst, cmidi2_ump_system_message(
-                        0, data[eventPos],
-                        eventSize > 1 ? data[eventPos + 1] : 0,
-                        eventSize > 2 ? data[eventPos + 2] : 0));
-                umpDst++;
-                dstBufSize += 4;
-            } else {
-                cmidi2_ump_write32(umpDst, cmidi2_ump_midi1_message(
-                        0, data[eventPos] & 0xF0, data[eventPos] & 0xF,
-                        eventSize > 1 ? data[eventPos + 1] : 0,
-                        eventSize > 2 ? data[eventPos + 2] : 0));
-                umpDst++;
-                dstBufSize += 4;
-            }
-        }
-        outMidiBuf->length = dstBufSize;
+        if (block.aap_midi2_out_port < 0)
+            return 0;
+
+        auto outMidiBuf = (AAPMidiBufferHeader*) buffer->get_buffer(buffer, block.aap_midi2_out_port);
+        auto capacity = (int64_t) buffer->get_buffer_size(buffer, block.aap_midi2_out_port) - (int64_t) sizeof(AAPMidiBufferHeader) - outMidiBuf->length;
+        if (capacity <= 0)
+            return 0;
+        cmidi2_ump_forge forge;
+        cmidi2_ump_forge_init(&forge, (cmidi2_ump*) (void*) ((uint8_t*) outMidiBuf + sizeof(AAPMidiBufferHeader) + outMidiBuf->length), (size_t) capacity);
+
+        // Sample positions are turned into delta JR timestamps, emitted only when the position moves.
+        // If the port buffer is full, the rest of the events are dropped.
+        int64_t lastTicks = 0;
+        juceaap_addMidiBufferAsUmp(&forge, juce_midi_messages, block.sample_rate, false, &lastTicks);
+        outMidiBuf->length += (uint32_t) forge.offset;
+        return lastTicks;
     }
 
     void clearMidiOutput(aap_buffer_t* buffer) {
-        if (aap_midi2_out_port < 0)
+        if (block.aap_midi2_out_port < 0)
             return;
 
-        if ((uint32_t) aap_midi2_out_port >= buffer->num_ports(buffer))
+        if ((uint32_t) block.aap_midi2_out_port >= buffer->num_ports(buffer))
             return;
 
-        auto* outMidiBuf = (AAPMidiBufferHeader*) buffer->get_buffer(buffer, aap_midi2_out_port);
+        auto* outMidiBuf = (AAPMidiBufferHeader*) buffer->get_buffer(buffer, block.aap_midi2_out_port);
         outMidiBuf->length = 0;
     }
 
-    void resetJuceChannels(aap_buffer_t *audioBuffer, int32_t frameCount) {
-        int nOut = juce_processor->getMainBusNumOutputChannels();
-        int nIn = juce_processor->getMainBusNumInputChannels();
-        auto numFrames = audioBuffer->num_frames(audioBuffer);
-        if (frameCount > numFrames) {
-            aap::a_log_f(AAP_LOG_LEVEL_ERROR, AAP_JUCE_TAG, "frameCount is bigger than numFrames from aap_buffer_t.");
-            frameCount = numFrames;
-        }
+    void compileRoutingPlan(aap_buffer_t *audioBuffer) {
+        for (auto& route : audio_out_routes)
+            route.port_buffer = (float*) audioBuffer->get_buffer(audioBuffer, route.aap_port);
+        for (auto& route : audio_in_routes)
+            route.port_buffer = (float*) audioBuffer->get_buffer(audioBuffer, route.aap_port);
 
         // Assign JUCE out channel buffer ONLY IF it is not assigned for inputs.
         // To achieve that, first fill output buffer pointers, then overwrite by input buffer pointers.
         // (They must be two separate passes; AAP port order is not guaranteed, and e.g. the
         // default port configuration in aap-core lists input ports before output ports.)
-        for (int i = 0; i < audioBuffer->num_ports(audioBuffer); i++) {
-            auto iterOut = aap_to_juce_portmap_out.find(i);
-            if (iterOut != aap_to_juce_portmap_out.end())
-                juce_channels[iterOut->second] = (float*) audioBuffer->get_buffer(audioBuffer, i);
+        for (auto& route : audio_out_routes)
+            juce_channels[route.juce_channel] = route.port_buffer;
+        for (auto& route : audio_in_routes)
+            juce_channels[route.juce_channel] = route.port_buffer;
+
+        // JUCE processes in place, so the outputs of the channels that are shared with inputs have to be
+        // copied back to the AAP output ports, unless the host gave the same buffer to both ports.
+        audio_out_copies.clear();
+        for (auto& route : audio_out_routes)
+            if (juce_channels[route.juce_channel] != route.port_buffer)
+                audio_out_copies.push_back(AudioChannelCopy{juce_channels[route.juce_channel], route.port_buffer});
+
+        // whether there are output copies is part of the kernel selection.
+        selectProcessKernel();
+    }
+
+    bool isRoutingPlanStale(aap_buffer_t *audioBuffer) {
+        for (auto& route : audio_in_routes)
+            if (audioBuffer->get_buffer(audioBuffer, route.aap_port) != route.port_buffer)
+                return true;
+        for (auto& route : audio_out_routes)
+            if (audioBuffer->get_buffer(audioBuffer, route.aap_port) != route.port_buffer)
+                return true;
+        return false;
+    }
+
+    void resetJuceChannels(aap_buffer_t *audioBuffer, int32_t frameCount) {
+        juce_audio_buffer.setDataToReferTo(juce_channels.get(), block.num_juce_channels, frameCount);
+    }
+
+    static inline int64_t getMonotonicNanoseconds() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+    }
+
+    bool shouldSubstituteBlock() {
+#if JUCEAAP_PROCESS_DEADLINE_POLICY == JUCEAAP_PROCESS_DEADLINE_POLICY_REPORT
+        return false;
+#else
+        return block.consecutive_deadline_overruns >= JUCEAAP_PROCESS_DEADLINE_MAX_CONSECUTIVE_OVERRUNS;
+#endif
+    }
+
+    // Fills the block without running processBlock(), then gives the processor another chance.
+    void substituteBlock(int32_t frameCount) {
+#if JUCEAAP_PROCESS_DEADLINE_POLICY == JUCEAAP_PROCESS_DEADLINE_POLICY_LAST_GOOD_BLOCK
+        for (int ch = 0; ch < block.num_juce_channels; ch++)
+            juce_audio_buffer.copyFrom(ch, 0, last_good_block, ch, 0, jmin(frameCount, last_good_block.getNumSamples()));
+#else
+        juce_audio_buffer.clear();
+#endif
+        // the MIDI inputs must not appear as outputs, but the parameter changes still have to be applied,
+        // and whatever releases notes is given to the processor at the beginning of the next block.
+        for (const auto metadata : juce_midi_messages) {
+            auto message = metadata.getMessage();
+            if (message.isNoteOff() || message.isAllNotesOff() || message.isAllSoundOff() || message.isSustainPedalOff())
+                deferred_midi_messages.addEvent(metadata.data, metadata.numBytes, 0);
+        }
+        juce_midi_messages.clear();
+#if JUCEAAP_SAMPLE_ACCURATE_PARAMETERS
+        for (size_t i = 0; i < num_timed_parameter_changes; i++) {
+            auto& change = timed_parameter_changes[i];
+            applyParameterChange(findParameterBinding(change.id), change.id, change.normalized_value);
         }
-        for (int i = 0; i < audioBuffer->num_ports(audioBuffer); i++) {
-            auto iterIn = aap_to_juce_portmap_in.find(i);
-            if (iterIn != aap_to_juce_portmap_in.end())
-                juce_channels[iterIn->second] = (float*) audioBuffer->get_buffer(audioBuffer, i);
+        num_timed_parameter_changes = 0;
+#endif
+        advancePlayHead(frameCount);
+        block.consecutive_deadline_overruns = 0;
+    }
+
+    void checkDeadline(int64_t beginNanoseconds, int64_t timeoutInNanoseconds, int32_t frameCount) {
+        auto elapsed = getMonotonicNanoseconds() - beginNanoseconds;
+        if (elapsed <= timeoutInNanoseconds) {
+            block.consecutive_deadline_overruns = 0;
+#if JUCEAAP_PROCESS_DEADLINE_POLICY == JUCEAAP_PROCESS_DEADLINE_POLICY_LAST_GOOD_BLOCK
+            for (int ch = 0; ch < block.num_juce_channels; ch++)
+                last_good_block.copyFrom(ch, 0, juce_audio_buffer, ch, 0, jmin(frameCount, last_good_block.getNumSamples()));
+#endif
+            return;
         }
+        num_deadline_overruns++;
+        block.deadline_overruns_notification_pending = true;
+        block.consecutive_deadline_overruns++;
+        if (juceaap_onProcessDeadlineExceeded != nullptr)
+            juceaap_onProcessDeadlineExceeded(juce_processor, elapsed, timeoutInNanoseconds, block.consecutive_deadline_overruns);
+    }
 
-        juce_audio_buffer = juce::AudioBuffer<float>(juce_channels, jmax(nIn, nOut), frameCount);
+    void advancePlayHead(int32_t frameCount) {
+#if JUCEAAP_HAVE_AUDIO_PLAYHEAD_NEW_POSITION_INFO
+        play_head_position.setTimeInSamples(play_head_position.getTimeInSamples().orFallback(0) + frameCount);
+        auto thisTimeInSeconds = 1.0 * frameCount / block.sample_rate;
+        play_head_position.setTimeInSeconds(play_head_position.getTimeInSeconds().orFallback(0.0) + thisTimeInSeconds);
+        play_head_position.setPpqPosition(play_head_position.getPpqPosition().orFallback(0.0) + play_head_position.getBpm().orFallback(120.0) / 60 * thisTimeInSeconds);
+#else
+        play_head_position.timeInSamples += frameCount;
+        auto thisTimeInSeconds = 1.0 * frameCount / block.sample_rate;
+        play_head_position.timeInSeconds += thisTimeInSeconds;
+        play_head_position.ppqPosition += play_head_position.bpm / 60 * thisTimeInSeconds;
+#endif
     }
 
     const char *AAP_JUCE_TRACE_SECTION_NAME = "aap-juce_process";
     const char *AAP_JUCE_DSP_TRACE_SECTION_NAME = "aap-juce_process_dsp";
 
+    // process() kernels, specialized at compile time on what the plugin and its ports need.
+    // prepare() (and routing plan recompilation) selects one of them and installs it as
+    // AndroidAudioPlugin::process, so that e.g. pure audio effects skip all the MIDI machinery.
+    enum ProcessKernelFlags {
+        PROCESS_KERNEL_MIDI_IN = 1,
+        PROCESS_KERNEL_MIDI_OUT = 2,
+        PROCESS_KERNEL_PARAMETER_OUT = 4,
+        PROCESS_KERNEL_COPY_OUT = 8
+    };
+
+    template <int Flags>
+    static void processKernel(AndroidAudioPlugin *plugin, aap_buffer_t *audioBuffer, int32_t frameCount, int64_t timeoutInNanoseconds) {
+        ((JuceAAPWrapper*) plugin->plugin_specific)->processWith<
+                (Flags & PROCESS_KERNEL_MIDI_IN) != 0,
+                (Flags & PROCESS_KERNEL_MIDI_OUT) != 0,
+                (Flags & PROCESS_KERNEL_PARAMETER_OUT) != 0,
+                (Flags & PROCESS_KERNEL_COPY_OUT) != 0>(audioBuffer, frameCount, timeoutInNanoseconds);
+    }
+
+    void selectProcessKernel() {
+        static const ProcessKernel kernels[16] = {
+                processKernel<0>, processKernel<1>, processKernel<2>, processKernel<3>,
+                processKernel<4>, processKernel<5>, processKernel<6>, processKernel<7>,
+                processKernel<8>, processKernel<9>, processKernel<10>, processKernel<11>,
+                processKernel<12>, processKernel<13>, processKernel<14>, processKernel<15>
+        };
+        int flags = 0;
+        if (block.aap_midi2_in_port >= 0)
+            flags |= PROCESS_KERNEL_MIDI_IN;
+        // There isn't anything we can send to AAP MIDI2 output port if it does not exist, so far.
+        if (block.aap_midi2_out_port >= 0 && juce_processor->producesMidi())
+            flags |= PROCESS_KERNEL_MIDI_OUT;
+        if (block.aap_midi2_out_port >= 0)
+            flags |= PROCESS_KERNEL_PARAMETER_OUT;
+        if (!audio_out_copies.empty())
+            flags |= PROCESS_KERNEL_COPY_OUT;
+        block.process_kernel = kernels[flags];
+        aap->process = block.process_kernel;
+    }
+
+    // It is used only until prepare() installs the selected kernel as AndroidAudioPlugin::process.
     void process(aap_buffer_t *audioBuffer, int32_t frameCount, int64_t timeoutInNanoseconds) {
+        block.process_kernel(aap, audioBuffer, frameCount, timeoutInNanoseconds);
+    }
+
+    template <bool MidiIn, bool MidiOut, bool ParameterOut, bool CopyOut>
+    void processWith(aap_buffer_t *audioBuffer, int32_t frameCount, int64_t timeoutInNanoseconds) {
+        if (isRoutingPlanStale(audioBuffer)) {
+            // the recompiled plan may need another kernel.
+            compileRoutingPlan(audioBuffer);
+            block.process_kernel(aap, audioBuffer, frameCount, timeoutInNanoseconds);
+            return;
+        }
+
 #if ANDROID
         struct timespec tsBegin, tsEnd;
         struct timespec tsDspBegin, tsDspEnd;
-        if (ATrace_isEnabled()) {
+        bool tracing = ATrace_isEnabled();
+        if (tracing) {
             clock_gettime(CLOCK_REALTIME, &tsBegin);
             ATrace_beginSection(AAP_JUCE_TRACE_SECTION_NAME);
         }
 #endif
+        int64_t deadlineBegin = timeoutInNanoseconds > 0 ? getMonotonicNanoseconds() : 0;
         auto numFrames = audioBuffer->num_frames(audioBuffer);
         if (frameCount > numFrames) {
             aap::a_log_f(AAP_LOG_LEVEL_ERROR, AAP_JUCE_TAG, "frameCount is bigger than numFrames from aap_buffer_t.");
@@ -910,21 +1581,38 @@ public:
         }
         resetJuceChannels(audioBuffer, frameCount);
 
-        if (aap_midi2_in_port >= 0)
+        if constexpr (MidiIn) {
             processMidiInputs(audioBuffer, frameCount);
+            if (!deferred_midi_messages.isEmpty()) {
+                juce_midi_messages.addEvents(deferred_midi_messages, 0, -1, 0);
+                deferred_midi_messages.clear();
+            }
+        }
+        else if constexpr (MidiOut)
+            juce_midi_messages.clear();
 
         // process data by the JUCE plugin
 #if ANDROID
-        if (ATrace_isEnabled()) {
+        if (tracing) {
             clock_gettime(CLOCK_REALTIME, &tsDspBegin);
             ATrace_beginSection(AAP_JUCE_DSP_TRACE_SECTION_NAME);
         }
 #endif
 
-        juce_processor->processBlock(juce_audio_buffer, juce_midi_messages);
+        bool substitute = shouldSubstituteBlock();
+        if (substitute)
+            substituteBlock(frameCount);
+#if JUCEAAP_SAMPLE_ACCURATE_PARAMETERS
+        else if (MidiIn && num_timed_parameter_changes > 0)
+            processBlockInSlices(frameCount);
+#endif
+        else {
+            juce_processor->processBlock(juce_audio_buffer, juce_midi_messages);
+            advancePlayHead(frameCount);
+        }
 
 #if ANDROID
-        if (ATrace_isEnabled()) {
+        if (tracing) {
             clock_gettime(CLOCK_REALTIME, &tsDspEnd);
             ATrace_setCounter(AAP_JUCE_DSP_TRACE_SECTION_NAME,
                               (tsDspEnd.tv_sec - tsDspBegin.tv_sec) * 1000000000 + tsDspEnd.tv_nsec - tsDspBegin.tv_nsec);
@@ -932,35 +1620,23 @@ public:
         }
 #endif
 
-#if JUCEAAP_HAVE_AUDIO_PLAYHEAD_NEW_POSITION_INFO
-        play_head_position.setTimeInSamples(play_head_position.getTimeInSamples().orFallback(0) + frameCount);
-        auto thisTimeInSeconds = 1.0 * frameCount / sample_rate;
-        play_head_position.setTimeInSeconds(play_head_position.getTimeInSeconds().orFallback(0.0) + thisTimeInSeconds);
-        play_head_position.setPpqPosition(play_head_position.getPpqPosition().orFallback(0.0) + play_head_position.getBpm().orFallback(120.0) / 60 * thisTimeInSeconds);
-#else
-        play_head_position.timeInSamples += frameCount;
-        auto thisTimeInSeconds = 1.0 * frameCount / sample_rate;
-        play_head_position.timeInSeconds += thisTimeInSeconds;
-        play_head_position.ppqPosition += play_head_position.bpm / 60 * thisTimeInSeconds;
-#endif
+        if (timeoutInNanoseconds > 0 && !substitute)
+            checkDeadline(deadlineBegin, timeoutInNanoseconds, frameCount);
 
-        clearMidiOutput(audioBuffer);
+        if constexpr (MidiOut || ParameterOut)
+            clearMidiOutput(audioBuffer);
+        int64_t midiOutTicks = 0;
+        if constexpr (MidiOut)
+            midiOutTicks = processMidiOutputs(audioBuffer);
+        if constexpr (ParameterOut)
+            flushParameterChanges(audioBuffer, frameCount, midiOutTicks);
 
-        // There isn't anything we can send to AAP MIDI2 output port if it does not exist, so far.
-        if (juce_processor->producesMidi())
-            processMidiOutputs(audioBuffer);
-        flushParameterChanges(audioBuffer);
-
-        int numAudioIns = juce_processor->getMainBusNumInputChannels();
-        int numAudioOuts = juce_processor->getMainBusNumOutputChannels();
-        int numCopied = numAudioIns < numAudioOuts ? numAudioIns : numAudioOuts;
-        for (int i = 0; i < numCopied; i++) {
-            auto aapPortIndex = portmap_juce_to_aap_out[i];
-            memcpy(audioBuffer->get_buffer(audioBuffer, aapPortIndex), juce_channels[i], audioBuffer->num_frames(audioBuffer) * sizeof(float));
-        }
+        if constexpr (CopyOut)
+            for (auto& copy : audio_out_copies)
+                memcpy(copy.dst, copy.src, frameCount * sizeof(float));
 
 #if ANDROID
-        if (ATrace_isEnabled()) {
+        if (tracing) {
             clock_gettime(CLOCK_REALTIME, &tsEnd);
             ATrace_setCounter(AAP_JUCE_TRACE_SECTION_NAME,
                               (tsEnd.tv_sec - tsBegin.tv_sec) * 1000000000 + tsEnd.tv_nsec - tsBegin.tv_nsec);
@@ -1001,10 +1677,8 @@ public:
 
     void setState(aap_state_t *input) {
         juceaap_callOnExistingMessageThreadIfNeeded([&] {
-            auto oldValues = snapshotParameterValues();
             juce_processor->setStateInformation(input->data, input->data_size);
-            enqueueChangedParameters(oldValues);
-            last_parameter_values = snapshotParameterValues();
+            enqueueChangedParameters();
         });
     }
 
@@ -1030,30 +1704,27 @@ public:
     int32_t getAAPParameterCount() { return aapParams.size(); }
     aap_parameter_info_t getAAPParameterInfo(int index) { return *aapParams[index]; }
     AudioProcessorParameter* findJUCEParameter(int id) {
-        for (auto p : juce_processor->getParameterTree().getParameters(true))
-            if (p->getParameterIndex() == id)
-                return p;
-        return nullptr;
+        auto* binding = findParameterBinding(id);
+        return binding != nullptr ? binding->parameter : nullptr;
     }
     double getAAPParameterProperty(int32_t parameterId, int32_t propertyId) {
-        for (auto info: aapParams) {
-            if (info->stable_id == parameterId) {
-                switch (propertyId) {
-                    case AAP_PARAMETER_PROPERTY_MIN_VALUE:
-                        return info->min_value;
-                    case AAP_PARAMETER_PROPERTY_MAX_VALUE:
-                        return info->max_value;
-                    case AAP_PARAMETER_PROPERTY_DEFAULT_VALUE:
-                        return info->default_value;
-                    case AAP_PARAMETER_PROPERTY_IS_DISCRETE: {
-                        auto p = findJUCEParameter(parameterId);
-                        return p != nullptr && p->isDiscrete();
-                    }
-                    // JUCE does not have it (yet?)
-                    case AAP_PARAMETER_PROPERTY_PRIORITY:
-                        return 0;
-                }
+        auto* info = findAAPParameterInfoById(parameterId);
+        if (info == nullptr)
+            return 0;
+        switch (propertyId) {
+            case AAP_PARAMETER_PROPERTY_MIN_VALUE:
+                return info->min_value;
+            case AAP_PARAMETER_PROPERTY_MAX_VALUE:
+                return info->max_value;
+            case AAP_PARAMETER_PROPERTY_DEFAULT_VALUE:
+                return info->default_value;
+            case AAP_PARAMETER_PROPERTY_IS_DISCRETE: {
+                auto p = findJUCEParameter(parameterId);
+                return p != nullptr && p->isDiscrete();
             }
+            // JUCE does not have it (yet?)
+            case AAP_PARAMETER_PROPERTY_PRIORITY:
+                return 0;
         }
         return 0;
     }
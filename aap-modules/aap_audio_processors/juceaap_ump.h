@@ -0,0 +1 @@
+../aap_audio_plugin_client/juceaap_ump.h
\ No newline at end of file